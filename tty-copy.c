@@ -5,14 +5,32 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <iconv.h>
 #include <paths.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PROGNAME "tty-copy"
@@ -21,39 +39,132 @@
   #define VERSION "0.2.2"
 #endif
 
+// Nanoseconds of the modification time; macOS doesn't have st_mtim in the
+// POSIX mode.
+#ifdef __APPLE__
+  #define ST_MTIME_NSEC(st) ((st)->st_mtimensec)
+#else
+  #define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+#define OP_BUNDLE 'B'
 #define OP_CLEAR 'c'
+#define OP_EXEC 'e'
+#define OP_LISTEN 'l'
+#define OP_METRICS 'M'
+#define OP_PASTE_LOCAL 'P'
 #define OP_TEST 't'
 #define OP_WRITE 'w'
 
 #define ERR_GENERAL 1
 #define ERR_WRONG_USAGE 10
 #define ERR_IO 11
+#define ERR_EXEC 127
+
+#define CAPTURE_STDOUT 0x01
+#define CAPTURE_STDERR 0x02
 
 // The maximum length of an OSC 52 sequence is originally 100 000 bytes, of
 // which 7 bytes is "\033]52;c;" header, 1 byte is "\a" footer, and 99 992
 // bytes by the base64-encoded result of 74 994 bytes of copyable text.
 #define OSC_SAFE_LIMIT 74994
 
+// How long to wait for the terminal's response to DA1 with --sync.
+#define SYNC_TIMEOUT_MS 10000
+
+// Layout of the local clipboard ring in shared memory; the magic number
+// includes the layout version.
+#define RING_MAGIC 0x54435203
+#define RING_SLOTS 16
+#define RING_SLOT_SIZE (256 * 1024)
+// A writer checks that it still owns the slot after every chunk of this size.
+#define RING_COPY_CHUNK (16 * 1024)
+// How many times a reader retries if the entry is being written.
+#define RING_READ_RETRIES 100
+
+// Layout of the metrics file; the magic number includes the layout version.
+// Copy durations are counted in buckets with upper bounds 2^(k + 7) us,
+// i.e. from 128 us up to ~16.8 s, plus +Inf.
+#define METRICS_MAGIC 0x54434D01
+#define METRICS_BUCKETS 18
+#define METRICS_FILENAME PROGNAME ".metrics"
+
+// Format of the compiled terminal profiles cache; the magic number includes
+// the format version.
+#define PROFILES_MAGIC 0x54435002
+#define PROFILES_FILENAME "profiles"
+#define PROFILES_CACHE_FILENAME "profiles.bin"
+// Maximum chunk size that can be set in a profile.
+#define PROFILES_MAX_CHUNK (1024 * 1024)
+
+// Size of the buffer for reading the input.
+#define READ_BUF_SIZE (2048 * 3)
+
+// Parameters of the prefetching reader for regular files: number of reader
+// threads, size of the block read at once, and number of blocks read ahead.
+#define PREFETCH_THREADS 4
+#define PREFETCH_BLOCK_SIZE (256 * 1024)
+#define PREFETCH_SLOTS 8
+
 #define logerr(format, ...) \
 	fprintf(stderr, PROGNAME ": " format "\n", __VA_ARGS__)
 
 typedef unsigned char uchar;
 
+extern char **environ;
+
+// A line pattern given by --match or --exclude.
+struct pattern {
+	const char *str;
+	size_t len;
+	regex_t *re;  // NULL if the pattern is a literal string
+};
+
 static const char * const help_msg =
 	"Usage:\n"
 	"  " PROGNAME " [options] text to copy\n"
 	"  " PROGNAME " [options] < file-to-copy\n"
+	"  " PROGNAME " [options] --bundle file...\n"
+	"  " PROGNAME " [options] --listen socket\n"
+	"  " PROGNAME " [options] --exec -- command [args...]\n"
+	"  " PROGNAME " --paste-local [n]\n"
+	"  " PROGNAME " --metrics\n"
 	"  " PROGNAME " (-t | -V | -h)\n"
 	"\n"
 	"Copy content to the system clipboard from anywhere via terminal that supports\n"
 	"ANSI OSC 52 sequence.\n"
 	"\n"
 	"Options:\n"
+	"  -b --backend NAME  Use the specified backend: auto (default), socket,\n"
+	"                     wayland, x11, tmux, screen, tty, or local.\n"
+	"  -B --bundle        Copy the given files as a compressed tar archive embedded\n"
+	"                     in a shell snippet that extracts them when pasted.\n"
+	"  -C --capture WHAT  Output of the --exec command to copy: stdout, stderr, or\n"
+	"                     all (default).\n"
 	"  -c --clear         Instead of copying anything, clear the clipboard.\n"
+	"  -e --exec          Run the command given after \"--\", pass its output through\n"
+	"                     and copy it when the command exits.\n"
+	"  -f --from-charset CHARSET\n"
+	"                     Convert the input from CHARSET to UTF-8. Use \"auto\" to\n"
+	"                     detect UTF-8 and UTF-16 by the byte order mark.\n"
+	"  -l --listen PATH   Listen on the Unix socket PATH and copy data received\n"
+	"                     from " PROGNAME " --socket.\n"
+	"  -m --match PATTERN Copy only lines matching the extended regular expression\n"
+	"                     PATTERN (can be repeated).\n"
+	"  -x --exclude PATTERN\n"
+	"                     Do not copy lines matching PATTERN (can be repeated).\n"
+	"  -M --metrics       Print the aggregated metrics of all runs in Prometheus text\n"
+	"                     format and exit.\n"
 	"  -n --trim-newline  Do not copy the trailing newline character.\n"
 	"  -o --output FILE   Path of the terminal device (defaults to /dev/tty).\n"
+	"  -P --paste-local   Print the n-th (default 1st) most recent entry of the local\n"
+	"                     clipboard ring (see --backend local) and exit.\n"
 	"  -p --primary       Use the \"primary\" clipboard (selection) instead of the\n"
 	"                     regular clipboard.\n"
+	"  -S --sync          Wait until the terminal processes the sequence and print\n"
+	"                     how long it took.\n"
+	"  -s --socket PATH   Send the data to " PROGNAME " --listen on the Unix socket\n"
+	"                     PATH (e.g. forwarded over SSH).\n"
 	"  -T --term TERM     Type of the terminal: (default), screen, or tmux.\n"
 	"  -t --test          Test if your terminal processes OSC 52 sequence.\n"
 	"  -V --version       Print program name & version and exit.\n"
@@ -67,8 +178,23 @@ static struct {
 	bool is_screen;
 	bool is_tmux;
 	bool primary;
+	bool sync;
 	bool trim_newline;
+	int capture;
+	size_t chunk_size;     // 0 for the default
+	size_t payload_limit;
+	long pacing_us;
 	char *tty_path;
+	bool tty_path_given;
+	char *from_charset;
+	char *backend;
+	bool backend_given;
+	char *socket_path;
+	char *listen_path;
+	struct pattern *match;
+	size_t match_cnt;
+	struct pattern *exclude;
+	size_t exclude_cnt;
 } opts = {0};
 
 /**
@@ -85,14 +211,52 @@ static bool str_equal (const char *str1, const char *str2) {
 	return strcmp(str1, str2) == 0;
 }
 
+/**
+ * Compiles the given `pattern` and appends it to the `patterns` array.
+ * Patterns without any ERE special characters are matched as literal strings,
+ * which is much faster than going through regexec(3).
+ */
+static void add_pattern (struct pattern **patterns, size_t *cnt, const char *pattern) {
+	struct pattern pat = { .str = pattern, .len = strlen(pattern), .re = NULL };
+
+	if (strpbrk(pattern, "\\^$.[]|()*+?{}") != NULL) {
+		int err;
+		if ((pat.re = malloc(sizeof(*pat.re))) == NULL) {
+			abort();
+		}
+		if ((err = regcomp(pat.re, pattern, REG_EXTENDED | REG_NOSUB)) != 0) {
+			char msg[128];
+			regerror(err, pat.re, msg, sizeof(msg));
+			logerr("Invalid pattern '%s': %s", pattern, msg);
+			exit(ERR_WRONG_USAGE);
+		}
+	}
+	if ((*patterns = realloc(*patterns, (*cnt + 1) * sizeof(pat))) == NULL) {
+		abort();
+	}
+	(*patterns)[(*cnt)++] = pat;
+}
+
 static void parse_opts (int argc, char * const *argv) {
 	assert(argc > 0 && "given zero argc");
 
-	const char *short_opts = "cno:pT:thV";
+	const char *short_opts = "b:BC:cef:l:Mm:no:Pps:ST:tx:hV";
 	static struct option long_opts[] = {
+		{"backend"     , required_argument, 0, 'b'},
+		{"bundle"      , no_argument      , 0, 'B'},
+		{"capture"     , required_argument, 0, 'C'},
 		{"clear"       , no_argument      , 0, 'c'},
+		{"exec"        , no_argument      , 0, 'e'},
+		{"exclude"     , required_argument, 0, 'x'},
+		{"from-charset", required_argument, 0, 'f'},
+		{"listen"      , required_argument, 0, 'l'},
+		{"match"       , required_argument, 0, 'm'},
+		{"metrics"     , no_argument      , 0, 'M'},
 		{"output"      , required_argument, 0, 'o'},
+		{"paste-local" , no_argument      , 0, 'P'},
 		{"primary"     , no_argument      , 0, 'p'},
+		{"socket"      , required_argument, 0, 's'},
+		{"sync"        , no_argument      , 0, 'S'},
 		{"term"        , required_argument, 0, 'T'},
 		{"test"        , no_argument      , 0, 't'},
 		{"trim-newline", no_argument      , 0, 'n'},
@@ -109,24 +273,72 @@ static void parse_opts (int argc, char * const *argv) {
 			optch = long_opts[optidx].val;
 		}
 		switch (optch) {
+			case 'b':
+				opts.backend = str_equal(optarg, "auto") ? NULL : strdup(optarg);
+				opts.backend_given = true;
+				break;
+			case 'B':
+				opts.op = OP_BUNDLE;
+				break;
+			case 'C':
+				if (str_equal(optarg, "stdout")) {
+					opts.capture = CAPTURE_STDOUT;
+				} else if (str_equal(optarg, "stderr")) {
+					opts.capture = CAPTURE_STDERR;
+				} else if (str_equal(optarg, "all")) {
+					opts.capture = CAPTURE_STDOUT | CAPTURE_STDERR;
+				} else {
+					logerr("Invalid value for --capture: %s", optarg);
+					exit(ERR_WRONG_USAGE);
+				}
+				break;
 			case 'c':
 				opts.op = OP_CLEAR;
 				break;
+			case 'e':
+				opts.op = OP_EXEC;
+				break;
+			case 'f':
+				opts.from_charset = strdup(optarg);
+				break;
+			case 'l':
+				opts.op = OP_LISTEN;
+				opts.listen_path = strdup(optarg);
+				break;
+			case 'M':
+				opts.op = OP_METRICS;
+				break;
+			case 'm':
+				add_pattern(&opts.match, &opts.match_cnt, optarg);
+				break;
 			case 'n':
 				opts.trim_newline = true;
 				break;
 			case 'o':
 				opts.tty_path = strdup(optarg);
+				opts.tty_path_given = true;
+				break;
+			case 'P':
+				opts.op = OP_PASTE_LOCAL;
 				break;
 			case 'p':
 				opts.primary = true;
 				break;
+			case 's':
+				opts.socket_path = strdup(optarg);
+				break;
+			case 'S':
+				opts.sync = true;
+				break;
 			case 'T':
 				term_type = strdup(optarg);
 				break;
 			case 't':
 				opts.op = OP_TEST;
 				break;
+			case 'x':
+				add_pattern(&opts.exclude, &opts.exclude_cnt, optarg);
+				break;
 			case 'h':
 				printf("%s", help_msg);
 				exit(EXIT_SUCCESS);
@@ -141,9 +353,21 @@ static void parse_opts (int argc, char * const *argv) {
 	if (!opts.op) {
 		opts.op = OP_WRITE;
 	}
+	if (opts.op == OP_BUNDLE && optind >= argc) {
+		logerr("%s", "No files to bundle specified");
+		exit(ERR_WRONG_USAGE);
+	}
+	if (opts.op == OP_EXEC && optind >= argc) {
+		logerr("%s", "No command to execute specified");
+		exit(ERR_WRONG_USAGE);
+	}
+	if (!opts.capture) {
+		opts.capture = CAPTURE_STDOUT | CAPTURE_STDERR;
+	}
 	if (opts.tty_path == NULL) {
 		opts.tty_path = _PATH_TTY;
 	}
+	opts.payload_limit = OSC_SAFE_LIMIT;
 
 	const char *term = NULL;
 	if (term_type != NULL) {
@@ -224,19 +448,6 @@ static size_t base64_encode (const uchar *src, size_t srclen, uchar *dst, size_t
 	return pos - dst;
 }
 
-/**
- * Returns the next character in the input `stream`, as a value of type `int`,
- * without extracting it: the character is pushed back onto the stream so that
- * the this is available for the next read operation. If there are no more
- * characters to read in the stream, `EOF` is returned.
- */
-static int fpeek (FILE *stream) {
-	const int ch = fgetc(stream);
-	ungetc(ch, stream);
-
-	return ch;
-}
-
 /**
  * Returns the cursor position on the X-axis (column), or -1 on error.
  */
@@ -260,6 +471,74 @@ static int get_cursor_column (FILE *tty) {
 	return col;
 }
 
+/**
+ * Returns the current value of the monotonic clock in milliseconds.
+ */
+static double now_ms (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Sends the DA1 (Primary Device Attributes) query to the terminal and waits
+ * for the response. Terminals process the input in order, so when the
+ * response arrives, everything written before has been processed.
+ *
+ * @param tty The terminal opened for reading and writing.
+ * @param timeout_ms How long to wait for the response.
+ * @return The number of milliseconds it took, or -1 on error or timeout.
+ */
+static double term_sync (FILE *tty, int timeout_ms) {
+	int fd = fileno(tty);
+	double start = now_ms();
+	// 0: expecting ESC, 1: '[', 2: '?', 3: parameters terminated by 'c'.
+	int state = 0;
+
+	if (fputs("\033[c", tty) < 0 || fflush(tty) != 0) {
+		return -1;
+	}
+	while (true) {
+		int remaining = timeout_ms - (int)(now_ms() - start);
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		uchar buf[64];
+
+		if (remaining <= 0) {
+			return -1;
+		}
+		int n = poll(&pfd, 1, remaining);
+		if (n < 0 && errno != EINTR) {
+			return -1;
+		}
+		if (n <= 0) {
+			continue;
+		}
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		for (ssize_t i = 0; i < len; i++) {
+			uchar ch = buf[i];
+
+			if (ch == '\033') {
+				state = 1;
+			} else if (state == 1) {
+				state = ch == '[' ? 2 : 0;
+			} else if (state == 2) {
+				state = ch == '?' ? 3 : 0;
+			} else if (state == 3 && ch == 'c') {
+				return now_ms() - start;
+			} else if (state == 3 && !(ch == ';' || (ch >= '0' && ch <= '9'))) {
+				state = 0;
+			}
+		}
+	}
+}
+
 /**
  * Changes the local modes of the terminal referred to by the open file descriptor `fd`.
  *
@@ -277,132 +556,2947 @@ static int term_change_local_modes (int fd, tcflag_t c_lflag) {
 	return tcsetattr(fd, TCSANOW, &term);
 }
 
-int main (int argc, char * const *argv) {
-	parse_opts(argc, argv);
+/**
+ * A stage of the output pipeline. Data pushed into the stage by `write` is
+ * processed and passed to the next stage, `close` flushes any buffered data.
+ * Both return 0 on success, or an exit code on error.
+ */
+struct sink {
+	int (*write) (struct sink *self, const uchar *data, size_t len);
+	int (*close) (struct sink *self);
+};
 
-	char seq_start[32];
-	sprintf(seq_start, "%s\033]52;%c;",
-		opts.is_tmux ? "\033Ptmux;\033" : "",
-		opts.primary ? 'p' : 'c');
+// Set when the input size exceeded the payload limit, for metrics.
+static bool truncation_warned = false;
 
-	const char *seq_end = opts.is_tmux ? "\a\033\\" : "\a";
+/**
+ * The final stage of the pipeline that base64-encodes data and writes it
+ * to the TTY wrapped in the OSC 52 sequence.
+ */
+struct osc_writer {
+	struct sink sink;
+	FILE *tty;
+	const char *seq_start;
+	const char *seq_end;
+	uchar *buf;         // pending data, up to `chunk_size` bytes
+	size_t len;
+	size_t chunk_size;  // must be divisible by 3 (because of base64)
+	size_t total;       // number of bytes written so far
+	bool started;
+	uchar *enc_buf;
+	size_t enc_size;
+};
 
-	FILE *tty = NULL;
-	if ((tty = fopen(opts.tty_path, "r+")) == NULL) {
-		logerr("Failed to open %s: %s", opts.tty_path, strerror(errno));
-		exit(ERR_IO);
+static int osc_writer_flush (struct osc_writer *w) {
+	if (opts.is_screen) {
+		fputs("\033P", w->tty);
+	}
+	if (!w->started) {
+		fputs(w->seq_start, w->tty);
+		w->started = true;
+	}
+	size_t len = base64_encode(w->buf, w->len, w->enc_buf, w->enc_size);
+	if (fwrite(w->enc_buf, 1, len, w->tty) != len) {
+		return ERR_IO;
+	}
+	if (opts.is_screen) {
+		fputs("\033\\", w->tty);
 	}
-	int tty_fd = fileno(tty);
+	w->len = 0;
 
-	struct termios term_restore;
-	if (isatty(tty_fd)) {
-		// Save the current terminal state so we can restore it later.
-		tcgetattr(tty_fd, &term_restore);
-		// Avoid mixing input with terminal output.
-		term_change_local_modes(tty_fd, ~(CREAD | ECHO | ICANON));
+	// Give a slow terminal time to process the chunk.
+	if (opts.pacing_us > 0) {
+		fflush(w->tty);
+		nanosleep(&(struct timespec) {
+			.tv_sec = opts.pacing_us / 1000000,
+			.tv_nsec = (opts.pacing_us % 1000000) * 1000,
+		}, NULL);
 	}
+	return 0;
+}
 
-	// TODO: refactor this spaghetti
+static int osc_writer_write (struct sink *self, const uchar *data, size_t len) {
+	struct osc_writer *w = (struct osc_writer *) self;
+	int rc = 0;
 
-	int rc = EXIT_SUCCESS;
-	if (opts.op == OP_TEST) {
-		fputs("\0337", tty);  // save current terminal state
+	w->total += len;
+	while (len > 0) {
+		size_t n = w->chunk_size - w->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(w->buf + w->len, data, n);
+		w->len += n;
+		data += n;
+		len -= n;
+
+		if (w->len == w->chunk_size && (rc = osc_writer_flush(w)) != 0) {
+			return rc;
+		}
+	}
+	return 0;
+}
 
-		int col = get_cursor_column(tty);
-		fprintf(tty, "%s%s", seq_start, seq_end);
-		int col2 = get_cursor_column(tty);
+static int osc_writer_close (struct sink *self) {
+	struct osc_writer *w = (struct osc_writer *) self;
+	int rc = 0;
 
-		if (col < 0 || col2 < 0 || col != col2) {
-			fputs("\0338", tty);  // restore terminal state
-			rc = ERR_GENERAL;
+	if (w->len > 0 || !w->started) {
+		rc = osc_writer_flush(w);
+	}
+	fputs(w->seq_end, w->tty);
+	fflush(w->tty);
+
+	if (opts.sync && rc == 0 && isatty(fileno(w->tty))) {
+		double start = now_ms();
+
+		// Wait until the sequence is transmitted to the terminal.
+		tcdrain(fileno(w->tty));
+
+		if (term_sync(w->tty, SYNC_TIMEOUT_MS) < 0) {
+			logerr("Terminal did not respond within %d s", SYNC_TIMEOUT_MS / 1000);
+			rc = ERR_IO;
+		} else {
+			logerr("Terminal processed the sequence in %.1f ms", now_ms() - start);
 		}
-	} else if (opts.op == OP_CLEAR) {
-		fprintf(tty, "%s!%s", seq_start, seq_end);
-		fflush(tty);
+	}
+	free(w->buf);
+	free(w->enc_buf);
 
-	} else {
-		FILE *input = stdin;
+	if (w->total > opts.payload_limit) {
+		if (opts.payload_limit < 1024) {
+			logerr("warning: Input size (%lu bytes) exceeded %lu bytes, it may be truncated by some terminals",
+				w->total, opts.payload_limit);
+		} else {
+			logerr("warning: Input size (%lu kiB) exceeded %lu kiB, it may be truncated by some terminals",
+				w->total / 1024, opts.payload_limit / 1024);
+		}
+		truncation_warned = true;
+	}
+	return rc;
+}
 
-		// There are remaining command line arguments, get the content from them
-		// instead of stdin.
-		if (argc > optind) {
-			char buf[OSC_SAFE_LIMIT] = "\0";
-			size_t buf_len = 0;
+/**
+ * Initializes the OSC 52 writer `w` that writes to `tty` in chunks of
+ * `chunk_size` bytes of the input data.
+ */
+static void osc_writer_init (struct osc_writer *w, FILE *tty, const char *seq_start,
+                             const char *seq_end, size_t chunk_size) {
+	assert(chunk_size % 3 == 0 && "chunk size must be divisible by 3");
 
-			for (int i = optind; i < argc; i++) {
-				size_t arg_len = strlen(argv[i]);
+	*w = (struct osc_writer) {
+		.sink = { .write = osc_writer_write, .close = osc_writer_close },
+		.tty = tty,
+		.seq_start = seq_start,
+		.seq_end = seq_end,
+		.chunk_size = chunk_size,
+		.enc_size = base64_encoded_size(chunk_size),
+	};
+	if ((w->buf = malloc(chunk_size)) == NULL || (w->enc_buf = malloc(w->enc_size)) == NULL) {
+		abort();
+	}
+}
 
-				if (buf_len + arg_len + 2 > sizeof(buf)) {
-					logerr("Command line is too long (limit is %lu bytes)", sizeof(buf));
-					rc = ERR_GENERAL;
-					goto done;
-				}
-				if (buf_len > 0) {
-					buf[buf_len++] = ' ';
-				}
-				(void) strcpy(buf + buf_len, argv[i]);
+/**
+ * A pipeline stage that drops the trailing newline of the data (--trim-newline).
+ */
+struct newline_trimmer {
+	struct sink sink;
+	struct sink *next;
+	bool pending;  // the last written byte was a newline that's held back
+};
 
-				buf[(buf_len += arg_len)] = '\0';
-			}
-			input = fmemopen(buf, buf_len, "r");
+static int newline_trimmer_write (struct sink *self, const uchar *data, size_t len) {
+	struct newline_trimmer *t = (struct newline_trimmer *) self;
+	int rc = 0;
+
+	if (len == 0) {
+		return 0;
+	}
+	if (t->pending && (rc = t->next->write(t->next, (const uchar *) "\n", 1)) != 0) {
+		return rc;
+	}
+	t->pending = data[len - 1] == '\n';
+
+	return t->pending && len == 1 ? 0 : t->next->write(t->next, data, len - t->pending);
+}
+
+static int newline_trimmer_close (struct sink *self) {
+	struct newline_trimmer *t = (struct newline_trimmer *) self;
+
+	return t->next->close(t->next);
+}
+
+static void newline_trimmer_init (struct newline_trimmer *t, struct sink *next) {
+	*t = (struct newline_trimmer) {
+		.sink = { .write = newline_trimmer_write, .close = newline_trimmer_close },
+		.next = next,
+	};
+}
+
+/**
+ * Returns a pointer to the first occurrence of `needle` in `haystack`, or NULL.
+ * This is memmem(3), which is not in POSIX. It's built on memchr(3) that is
+ * vectorized in all common libcs.
+ */
+static const uchar *mem_find (const uchar *haystack, size_t hlen, const uchar *needle, size_t nlen) {
+	if (nlen == 0) {
+		return haystack;
+	}
+	const uchar *end = haystack + hlen;
+	const uchar *p = haystack;
+
+	while ((size_t)(end - p) >= nlen && (p = memchr(p, needle[0], end - p - nlen + 1)) != NULL) {
+		if (memcmp(p, needle, nlen) == 0) {
+			return p;
 		}
+		p++;
+	}
+	return NULL;
+}
 
-		// Screen limits the length of string sequences, so we have to break it
-		// up to chunks of max 768 bytes.
-		// 2048 * 3 bytes for others is just an arbitrary number.
-		// IMPORTANT: The buffer size must be divisable by 3 (because of base64)!
-		uchar read_buf[(opts.is_screen ? 254 : 2048) * 3];
-		uchar enc_buf[base64_encoded_size(sizeof(read_buf))];
+/**
+ * A pipeline stage that passes through only the lines selected by --match
+ * and --exclude patterns.
+ */
+struct line_filter {
+	struct sink sink;
+	struct sink *next;
+	bool need_cstr;  // true if any pattern is a regex
+	uchar *line;     // incomplete line carried over from the previous write,
+	size_t line_len; // or a null-terminated copy of the line for regexec(3)
+	size_t line_cap;
+};
 
-		bool write_header = true;
-		size_t read_len = 0;
-		size_t input_len = 0;
-		while ((read_len = fread(read_buf, 1, sizeof(read_buf), input)) > 0) {
-			input_len += read_len;
+static void line_filter_reserve (struct line_filter *f, size_t size) {
+	if (size > f->line_cap) {
+		f->line_cap = size > f->line_cap * 2 ? size : f->line_cap * 2;
+		if ((f->line = realloc(f->line, f->line_cap)) == NULL) {
+			abort();
+		}
+	}
+}
 
-			if (opts.trim_newline && fpeek(input) == EOF && read_buf[read_len -1] == '\n') {
-				if (--read_len == 0) {
-					break;
-				}
-			}
-			if (opts.is_screen) {
-				fputs("\033P", tty);
-			}
-			if (write_header) {
-				fputs(seq_start, tty);
-				write_header = false;
-			}
-			size_t len = base64_encode(read_buf, read_len, enc_buf, sizeof(enc_buf));
-			if (fwrite(enc_buf, 1, len, tty) != len) {
-				rc = ERR_IO;
-				break;
+static bool patterns_match (const struct pattern *pats, size_t cnt, const uchar *line, size_t len) {
+	for (size_t i = 0; i < cnt; i++) {
+		if (pats[i].re != NULL) {
+			if (regexec(pats[i].re, (const char *) line, 0, NULL, 0) == 0) {
+				return true;
 			}
-			if (opts.is_screen) {
-				fputs("\033\\", tty);
+		} else if (mem_find(line, len, (const uchar *) pats[i].str, pats[i].len) != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Returns true if the `line` of the length `len` (without the newline) should
+ * be copied.
+ */
+static bool line_filter_test (struct line_filter *f, const uchar *line, size_t len) {
+	if (f->need_cstr) {
+		if (line != f->line) {
+			line_filter_reserve(f, len + 1);
+			memcpy(f->line, line, len);
+			line = f->line;
+		}
+		f->line[len] = '\0';
+	}
+	return (opts.match_cnt == 0 || patterns_match(opts.match, opts.match_cnt, line, len))
+		&& !patterns_match(opts.exclude, opts.exclude_cnt, line, len);
+}
+
+static int line_filter_write (struct sink *self, const uchar *data, size_t len) {
+	struct line_filter *f = (struct line_filter *) self;
+	const uchar *end = data + len;
+	const uchar *p = data;
+	const uchar *nl = NULL;
+	int rc = 0;
+
+	// Complete the line carried over from the previous write.
+	if (f->line_len > 0) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL) {
+			line_filter_reserve(f, f->line_len + len + 1);
+			memcpy(f->line + f->line_len, p, len);
+			f->line_len += len;
+			return 0;
+		}
+		size_t n = nl - p + 1;
+		line_filter_reserve(f, f->line_len + n + 1);
+		memcpy(f->line + f->line_len, p, n);
+		size_t line_len = f->line_len + n;
+		f->line_len = 0;
+		p = nl + 1;
+
+		bool selected = line_filter_test(f, f->line, line_len - 1);
+		// The test may have replaced the newline with the null terminator.
+		f->line[line_len - 1] = '\n';
+
+		if (selected && (rc = f->next->write(f->next, f->line, line_len)) != 0) {
+			return rc;
+		}
+	}
+
+	// Test the complete lines in place and pass through runs of the selected
+	// ones in a single write.
+	const uchar *run = p;
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		if (!line_filter_test(f, p, nl - p)) {
+			if (p > run && (rc = f->next->write(f->next, run, p - run)) != 0) {
+				return rc;
 			}
+			run = nl + 1;
 		}
-		fputs(seq_end, tty);
-		fflush(tty);
+		p = nl + 1;
+	}
+	if (p > run && (rc = f->next->write(f->next, run, p - run)) != 0) {
+		return rc;
+	}
 
-		if (ferror(input)) {
-			logerr("/dev/stdin: read error: %s", strerror(errno));
-			rc = ERR_IO;
+	if (p < end) {
+		line_filter_reserve(f, end - p + 1);
+		memcpy(f->line, p, end - p);
+		f->line_len = end - p;
+	}
+	return 0;
+}
+
+static int line_filter_close (struct sink *self) {
+	struct line_filter *f = (struct line_filter *) self;
+	int rc = 0;
+
+	// The last line without a trailing newline.
+	if (f->line_len > 0 && line_filter_test(f, f->line, f->line_len)) {
+		rc = f->next->write(f->next, f->line, f->line_len);
+	}
+	f->line_len = 0;
+
+	int rc2 = f->next->close(f->next);
+	return rc ? rc : rc2;
+}
+
+static void line_filter_init (struct line_filter *f, struct sink *next) {
+	*f = (struct line_filter) {
+		.sink = { .write = line_filter_write, .close = line_filter_close },
+		.next = next,
+	};
+	for (size_t i = 0; i < opts.match_cnt; i++) {
+		f->need_cstr |= opts.match[i].re != NULL;
+	}
+	for (size_t i = 0; i < opts.exclude_cnt; i++) {
+		f->need_cstr |= opts.exclude[i].re != NULL;
+	}
+}
+
+enum charset {
+	CHARSET_AUTO,
+	CHARSET_UTF8,
+	CHARSET_UTF16,  // big-endian unless there's BOM
+	CHARSET_UTF16BE,
+	CHARSET_UTF16LE,
+	CHARSET_LATIN1,
+	CHARSET_ICONV,
+};
+
+// Replacement character U+FFFD used for invalid input.
+static const uchar utf8_replacement[] = { 0xEF, 0xBF, 0xBD };
+
+/**
+ * A pipeline stage that converts data from the charset given by
+ * --from-charset to UTF-8. UTF-8, UTF-16 and Latin-1 are converted by
+ * a built-in code, any other charset via iconv(3).
+ */
+struct transcoder {
+	struct sink sink;
+	struct sink *next;
+	enum charset charset;
+	iconv_t cd;
+	bool bom_checked;
+	uchar in[READ_BUF_SIZE + 4];  // input with an incomplete char carried over
+	size_t in_len;
+	uchar out[(READ_BUF_SIZE + 4) * 2];
+};
+
+/**
+ * Parses the charset name; returns `CHARSET_ICONV` for unknown names.
+ */
+static enum charset charset_parse (const char *name) {
+	static const struct { const char *name; enum charset charset; } names[] = {
+		{ "auto"      , CHARSET_AUTO    },
+		{ "UTF-8"     , CHARSET_UTF8    },
+		{ "UTF8"      , CHARSET_UTF8    },
+		{ "UTF-16"    , CHARSET_UTF16   },
+		{ "UTF16"     , CHARSET_UTF16   },
+		{ "UTF-16BE"  , CHARSET_UTF16BE },
+		{ "UTF16BE"   , CHARSET_UTF16BE },
+		{ "UTF-16LE"  , CHARSET_UTF16LE },
+		{ "UTF16LE"   , CHARSET_UTF16LE },
+		{ "ISO-8859-1", CHARSET_LATIN1  },
+		{ "ISO8859-1" , CHARSET_LATIN1  },
+		{ "LATIN1"    , CHARSET_LATIN1  },
+	};
+	for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+		if (strcasecmp(name, names[i].name) == 0) {
+			return names[i].charset;
+		}
+	}
+	return CHARSET_ICONV;
+}
+
+/**
+ * Detects and skips the byte order mark at the start of the input, if it's
+ * consistent with the specified charset.
+ */
+static void transcoder_check_bom (struct transcoder *t) {
+	const uchar *in = t->in;
+	size_t skip = 0;
+
+	if (t->in_len >= 3 && in[0] == 0xEF && in[1] == 0xBB && in[2] == 0xBF) {
+		if (t->charset == CHARSET_AUTO || t->charset == CHARSET_UTF8) {
+			t->charset = CHARSET_UTF8;
+			skip = 3;
+		}
+	} else if (t->in_len >= 2 && in[0] == 0xFF && in[1] == 0xFE) {
+		if (t->charset == CHARSET_AUTO || t->charset == CHARSET_UTF16 || t->charset == CHARSET_UTF16LE) {
+			t->charset = CHARSET_UTF16LE;
+			skip = 2;
 		}
-		if (input_len > OSC_SAFE_LIMIT) {
-			logerr("warning: Input size (%lu kiB) exceeded %d kiB, it may be truncated by some terminals",
-				input_len / 1024, OSC_SAFE_LIMIT / 1024);
+	} else if (t->in_len >= 2 && in[0] == 0xFE && in[1] == 0xFF) {
+		if (t->charset == CHARSET_AUTO || t->charset == CHARSET_UTF16 || t->charset == CHARSET_UTF16BE) {
+			t->charset = CHARSET_UTF16BE;
+			skip = 2;
 		}
 	}
+	if (t->charset == CHARSET_AUTO) {
+		t->charset = CHARSET_UTF8;
+	} else if (t->charset == CHARSET_UTF16) {
+		t->charset = CHARSET_UTF16BE;
+	}
+	memmove(t->in, t->in + skip, t->in_len - skip);
+	t->in_len -= skip;
+	t->bom_checked = true;
+}
 
-	if (ferror(tty)) {
-		logerr("%s: write error: %s", opts.tty_path, strerror(errno));
-		rc = ERR_IO;
+/**
+ * Encodes the Unicode code point `cp` in UTF-8 into `out`. Returns number of
+ * bytes written.
+ */
+static size_t utf8_encode (uint32_t cp, uchar *out) {
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	} else if (cp < 0x800) {
+		out[0] = 0xC0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	} else if (cp < 0x10000) {
+		out[0] = 0xE0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3F);
+		out[2] = 0x80 | (cp & 0x3F);
+		return 3;
 	}
+	out[0] = 0xF0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3F);
+	out[2] = 0x80 | ((cp >> 6) & 0x3F);
+	out[3] = 0x80 | (cp & 0x3F);
+	return 4;
+}
 
-done:
-	if (isatty(tty_fd)) {
-		tcsetattr(tty_fd, TCSANOW, &term_restore);
+/**
+ * Converts UTF-16 in `in` of length `len` to UTF-8 in `out` (which must be
+ * at least 3/2 * `len` bytes long). An incomplete code unit or surrogate pair
+ * at the end is not consumed, unless `final` is true.
+ *
+ * @return Number of bytes written to `out`; `*consumed` is set to number of
+ *   bytes consumed from `in`.
+ */
+static size_t utf16_to_utf8 (const uchar *in, size_t len, bool big_endian, bool final,
+                             uchar *out, size_t *consumed) {
+	const int hi = big_endian ? 0 : 1;
+	const int lo = big_endian ? 1 : 0;
+	uchar *pos = out;
+	size_t i = 0;
+
+	while (len - i >= 2) {
+		uint32_t cu = (in[i + hi] << 8) | in[i + lo];
+
+		if (cu >= 0xD800 && cu <= 0xDBFF) {
+			if (len - i < 4) {
+				if (!final) {
+					break;
+				}
+				cu = 0xFFFD;
+			} else {
+				uint32_t cu2 = (in[i + 2 + hi] << 8) | in[i + 2 + lo];
+				if (cu2 >= 0xDC00 && cu2 <= 0xDFFF) {
+					cu = 0x10000 + ((cu - 0xD800) << 10) + (cu2 - 0xDC00);
+					i += 2;
+				} else {
+					cu = 0xFFFD;
+				}
+			}
+		} else if (cu >= 0xDC00 && cu <= 0xDFFF) {
+			cu = 0xFFFD;
+		}
+		pos += utf8_encode(cu, pos);
+		i += 2;
+	}
+	if (final && i < len) {
+		memcpy(pos, utf8_replacement, sizeof(utf8_replacement));
+		pos += sizeof(utf8_replacement);
+		i = len;
 	}
+	*consumed = i;
 
-	return rc;
+	return pos - out;
+}
+
+/**
+ * Converts Latin-1 in `in` of length `len` to UTF-8 in `out` (which must be
+ * at least 2 * `len` bytes long). Returns number of bytes written to `out`.
+ */
+static size_t latin1_to_utf8 (const uchar *in, size_t len, uchar *out) {
+	uchar *pos = out;
+
+	for (size_t i = 0; i < len; i++) {
+		if (in[i] < 0x80) {
+			*pos++ = in[i];
+		} else {
+			*pos++ = 0xC0 | (in[i] >> 6);
+			*pos++ = 0x80 | (in[i] & 0x3F);
+		}
+	}
+	return pos - out;
+}
+
+/**
+ * Converts the input using iconv(3) and passes the output to the next stage.
+ * An incomplete multibyte sequence at the end is kept in `t->in`, unless
+ * `final` is true.
+ */
+static int transcoder_iconv (struct transcoder *t, bool final) {
+	char *inptr = (char *) t->in;
+	size_t inleft = t->in_len;
+	int rc = 0;
+
+	while (inleft > 0 || final) {
+		char *outptr = (char *) t->out;
+		size_t outleft = sizeof(t->out);
+		bool stop = false;
+
+		// Passing NULL input at the end resets the shift state.
+		if (iconv(t->cd, inleft > 0 ? &inptr : NULL, &inleft, &outptr, &outleft) == (size_t) -1) {
+			switch (errno) {
+				case E2BIG:
+					break;
+				case EILSEQ:
+					if (outleft >= sizeof(utf8_replacement)) {
+						memcpy(outptr, utf8_replacement, sizeof(utf8_replacement));
+						outptr += sizeof(utf8_replacement);
+						inptr++;
+						inleft--;
+					}
+					break;
+				case EINVAL:
+					if (final) {
+						memcpy(outptr, utf8_replacement, sizeof(utf8_replacement));
+						outptr += sizeof(utf8_replacement);
+						inleft = 0;
+					}
+					stop = true;
+					break;
+				default:
+					return ERR_GENERAL;
+			}
+		} else if (inleft == 0) {
+			stop = final;
+		}
+		size_t len = (uchar *) outptr - t->out;
+		if (len > 0 && (rc = t->next->write(t->next, t->out, len)) != 0) {
+			return rc;
+		}
+		if (stop) {
+			break;
+		}
+	}
+	memmove(t->in, inptr, inleft);
+	t->in_len = inleft;
+
+	return 0;
+}
+
+/**
+ * Converts the data in `t->in` and passes it to the next stage.
+ */
+static int transcoder_convert (struct transcoder *t, bool final) {
+	size_t consumed = t->in_len;
+	size_t len = 0;
+
+	if (!t->bom_checked) {
+		// Wait for enough bytes to recognize the BOM.
+		if (t->in_len < 3 && !final) {
+			return 0;
+		}
+		transcoder_check_bom(t);
+		consumed = t->in_len;
+	}
+	switch (t->charset) {
+		case CHARSET_UTF8:
+			t->in_len = 0;
+			return consumed > 0 ? t->next->write(t->next, t->in, consumed) : 0;
+		case CHARSET_UTF16BE:
+		case CHARSET_UTF16LE:
+			len = utf16_to_utf8(t->in, t->in_len, t->charset == CHARSET_UTF16BE, final,
+			                    t->out, &consumed);
+			break;
+		case CHARSET_LATIN1:
+			len = latin1_to_utf8(t->in, t->in_len, t->out);
+			break;
+		case CHARSET_ICONV:
+			return transcoder_iconv(t, final);
+		default:
+			assert(false && "unexpected charset");
+	}
+	memmove(t->in, t->in + consumed, t->in_len - consumed);
+	t->in_len -= consumed;
+
+	return len > 0 ? t->next->write(t->next, t->out, len) : 0;
+}
+
+static int transcoder_write (struct sink *self, const uchar *data, size_t len) {
+	struct transcoder *t = (struct transcoder *) self;
+	int rc = 0;
+
+	while (len > 0) {
+		size_t n = sizeof(t->in) - t->in_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(t->in + t->in_len, data, n);
+		t->in_len += n;
+		data += n;
+		len -= n;
+
+		if ((rc = transcoder_convert(t, false)) != 0) {
+			return rc;
+		}
+	}
+	return 0;
+}
+
+static int transcoder_close (struct sink *self) {
+	struct transcoder *t = (struct transcoder *) self;
+
+	int rc = transcoder_convert(t, true);
+	if (t->charset == CHARSET_ICONV) {
+		iconv_close(t->cd);
+	}
+	int rc2 = t->next->close(t->next);
+	return rc ? rc : rc2;
+}
+
+/**
+ * Initializes the transcoder `t` from the given `charset` to UTF-8.
+ * Returns 0 on success, or -1 if the charset is not supported.
+ */
+static int transcoder_init (struct transcoder *t, const char *charset, struct sink *next) {
+	t->sink = (struct sink) { .write = transcoder_write, .close = transcoder_close };
+	t->next = next;
+	t->charset = charset_parse(charset);
+	t->bom_checked = t->charset == CHARSET_LATIN1 || t->charset == CHARSET_ICONV;
+	t->in_len = 0;
+
+	if (t->charset == CHARSET_ICONV) {
+		if ((t->cd = iconv_open("UTF-8", charset)) == (iconv_t) -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * A reader of regular files that keeps several pread(2) calls in flight ahead
+ * of the consumer and returns the blocks in order. On network filesystems
+ * like NFS or sshfs, a serial read loop is limited by the latency of each
+ * request rather than by bandwidth.
+ */
+struct prefetcher {
+	int fd;
+	off_t start;          // initial file offset
+	size_t blocks_cnt;    // number of blocks to read (based on the file size)
+	size_t next_block;    // next block to be claimed by a reader thread
+	size_t cur_block;     // block held by the consumer, or the next one
+	bool holding;         // the consumer holds `cur_block`
+	off_t consumed;       // number of bytes returned to the consumer
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[PREFETCH_THREADS];
+	int threads_cnt;
+	struct {
+		uchar *data;
+		ssize_t len;      // -1 on error
+		int err;
+		bool ready;
+	} slots[PREFETCH_SLOTS];
+};
+
+static void *prefetcher_thread (void *arg) {
+	struct prefetcher *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop) {
+		// Don't get more than PREFETCH_SLOTS blocks ahead of the consumer.
+		if (p->next_block >= p->blocks_cnt || p->next_block >= p->cur_block + PREFETCH_SLOTS) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+		size_t block = p->next_block++;
+		pthread_mutex_unlock(&p->lock);
+
+		uchar *data = p->slots[block % PREFETCH_SLOTS].data;
+		off_t offset = p->start + (off_t) block * PREFETCH_BLOCK_SIZE;
+		ssize_t len = 0;
+		ssize_t n = 0;
+		int err = 0;
+
+		while (len < PREFETCH_BLOCK_SIZE) {
+			if ((n = pread(p->fd, data + len, PREFETCH_BLOCK_SIZE - len, offset + len)) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				err = errno;
+				len = -1;
+				break;
+			} else if (n == 0) {
+				break;
+			}
+			len += n;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		p->slots[block % PREFETCH_SLOTS].len = len;
+		p->slots[block % PREFETCH_SLOTS].err = err;
+		p->slots[block % PREFETCH_SLOTS].ready = true;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/**
+ * Initializes the prefetcher `p` for reading the file `fd` from its current
+ * offset and starts the reader threads.
+ *
+ * @return 0 on success, or -1 if `fd` is not a regular file large enough to
+ *   benefit from it, or the threads could not be started.
+ */
+static int prefetcher_open (struct prefetcher *p, int fd) {
+	struct stat st;
+
+	*p = (struct prefetcher) { .fd = fd };
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+			|| (p->start = lseek(fd, 0, SEEK_CUR)) < 0
+			|| st.st_size - p->start < 2 * PREFETCH_BLOCK_SIZE) {
+		return -1;
+	}
+	p->blocks_cnt = (st.st_size - p->start + PREFETCH_BLOCK_SIZE - 1) / PREFETCH_BLOCK_SIZE;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, p->start, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, p->start, 0, POSIX_FADV_WILLNEED);
+#endif
+	for (int i = 0; i < PREFETCH_SLOTS; i++) {
+		if ((p->slots[i].data = malloc(PREFETCH_BLOCK_SIZE)) == NULL) {
+			abort();
+		}
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	for (int i = 0; i < PREFETCH_THREADS; i++) {
+		if (pthread_create(&p->threads[i], NULL, prefetcher_thread, p) != 0) {
+			break;
+		}
+		p->threads_cnt++;
+	}
+	if (p->threads_cnt == 0) {
+		for (int i = 0; i < PREFETCH_SLOTS; i++) {
+			free(p->slots[i].data);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Waits for the next block and sets `*data` to point to it. The block is valid
+ * until the next call.
+ *
+ * @return Length of the block, 0 if there are no more blocks, or -1 on error
+ *   (with errno set).
+ */
+static ssize_t prefetcher_next (struct prefetcher *p, const uchar **data) {
+	pthread_mutex_lock(&p->lock);
+
+	// Release the previous block.
+	if (p->holding) {
+		p->slots[p->cur_block % PREFETCH_SLOTS].ready = false;
+		p->cur_block++;
+		p->holding = false;
+		pthread_cond_broadcast(&p->cond);
+	}
+	if (p->cur_block >= p->blocks_cnt) {
+		pthread_mutex_unlock(&p->lock);
+		return 0;
+	}
+	size_t slot = p->cur_block % PREFETCH_SLOTS;
+	while (!p->slots[slot].ready) {
+		pthread_cond_wait(&p->cond, &p->lock);
+	}
+	ssize_t len = p->slots[slot].len;
+	if (len < 0) {
+		errno = p->slots[slot].err;
+	} else {
+		p->consumed += len;
+	}
+	*data = p->slots[slot].data;
+	p->holding = true;
+
+	// The last block, or the file has been truncated meanwhile.
+	if (len < PREFETCH_BLOCK_SIZE) {
+		p->blocks_cnt = p->cur_block + 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return len;
+}
+
+/**
+ * Stops the reader threads, frees the buffers and moves the file offset
+ * behind the data that has been returned by `prefetcher_next`.
+ */
+static void prefetcher_close (struct prefetcher *p) {
+	pthread_mutex_lock(&p->lock);
+	p->stop = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 0; i < p->threads_cnt; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+	for (int i = 0; i < PREFETCH_SLOTS; i++) {
+		free(p->slots[i].data);
+	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+
+	lseek(p->fd, p->start + p->consumed, SEEK_SET);
+}
+
+/**
+ * A dynamically growing byte buffer.
+ */
+struct buffer {
+	uchar *data;
+	size_t len;
+	size_t cap;
+};
+
+/**
+ * Ensures that the buffer `buf` has space for at least `size` more bytes.
+ */
+static void buffer_reserve (struct buffer *buf, size_t size) {
+	if (buf->len + size > buf->cap) {
+		size_t cap = buf->cap > 0 ? buf->cap * 2 : 4096;
+		while (cap < buf->len + size) {
+			cap *= 2;
+		}
+		if ((buf->data = realloc(buf->data, cap)) == NULL) {
+			abort();
+		}
+		buf->cap = cap;
+	}
+}
+
+static void buffer_append (struct buffer *buf, const void *data, size_t len) {
+	buffer_reserve(buf, len);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+/**
+ * Creates a pipe with the close-on-exec flag set on both ends.
+ * Returns 0 on success, -1 on error.
+ */
+static int pipe_cloexec (int fds[2]) {
+	if (pipe(fds) < 0) {
+		return -1;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+/**
+ * Writes all `len` bytes of `data` to the file descriptor `fd`, retrying on
+ * partial writes. Returns 0 on success, -1 on error.
+ */
+static int write_all (int fd, const void *data, size_t len) {
+	const uchar *pos = data;
+
+	while (len > 0) {
+		ssize_t n = write(fd, pos, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Spawns the command `argv` (searched in PATH) with stdin, stdout and stderr
+ * redirected to the given file descriptors, unless they are -1.
+ *
+ * @return PID of the child process, or -1 on error (with errno set).
+ */
+static pid_t spawn (char * const *argv, int in_fd, int out_fd, int err_fd) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdefault;
+	pid_t pid = -1;
+	int err = 0;
+
+	// We ignore SIGPIPE, but the command (and everything it runs) expects
+	// the default disposition.
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	}
+	if (out_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	}
+	if (err_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+	}
+	err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return pid;
+}
+
+/**
+ * Waits for the child process `pid` to terminate. Returns its exit status,
+ * or 128 + signal number if it has been killed by a signal.
+ */
+static int wait_child (pid_t pid) {
+	int status = 0;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**
+ * Runs the command `argv` with stdout and stderr connected to pipes, passes
+ * its output through to our stdout and stderr as it comes, and captures the
+ * streams selected by --capture into the buffer `out`.
+ *
+ * Both pipes are multiplexed with poll(2), so the captured output keeps the
+ * order in which the command has written it (as far as it can be observed).
+ *
+ * @return Exit status of the command, or -1 if it could not be executed.
+ */
+static int exec_capture (char * const *argv, struct buffer *out) {
+	int out_pipe[2] = {-1, -1};
+	int err_pipe[2] = {-1, -1};
+
+	if (pipe_cloexec(out_pipe) < 0 || pipe_cloexec(err_pipe) < 0) {
+		logerr("Failed to create pipe: %s", strerror(errno));
+		return -1;
+	}
+	pid_t pid = spawn(argv, -1, out_pipe[1], err_pipe[1]);
+	close(out_pipe[1]);
+	close(err_pipe[1]);
+
+	if (pid < 0) {
+		logerr("Failed to execute %s: %s", argv[0], strerror(errno));
+		close(out_pipe[0]);
+		close(err_pipe[0]);
+		return -1;
+	}
+
+	struct pollfd fds[2] = {
+		{ .fd = out_pipe[0], .events = POLLIN },
+		{ .fd = err_pipe[0], .events = POLLIN },
+	};
+	const int pass_fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	const int capture[2] = { CAPTURE_STDOUT, CAPTURE_STDERR };
+	uchar buf[4096];
+
+	while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (int i = 0; i < 2; i++) {
+			if (fds[i].fd < 0 || fds[i].revents == 0) {
+				continue;
+			}
+			ssize_t len = read(fds[i].fd, buf, sizeof(buf));
+			if (len < 0 && errno == EINTR) {
+				continue;
+			}
+			if (len <= 0) {
+				close(fds[i].fd);
+				fds[i].fd = -1;  // ignored by poll
+				continue;
+			}
+			// Errors of the passthrough (e.g. closed stdout) shouldn't
+			// prevent copying.
+			(void) write_all(pass_fds[i], buf, len);
+
+			if (opts.capture & capture[i]) {
+				buffer_append(out, buf, len);
+			}
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		if (fds[i].fd >= 0) {
+			close(fds[i].fd);
+		}
+	}
+	return wait_child(pid);
+}
+
+/**
+ * Creates a tar archive of the given `files`, compresses it and writes
+ * a shell snippet that extracts it to the buffer `out`.
+ *
+ * The first available compressor is used; zstd and pigz use all CPU cores.
+ * The host where the snippet is pasted needs the matching decompressor.
+ *
+ * @return 0 on success, or an exit code on error.
+ */
+static int bundle_files (char * const *files, int files_cnt, struct buffer *out) {
+	static const struct {
+		char *compress[6];
+		const char *decompress;
+	} compressors[] = {
+		{ { "zstd", "-q", "-19", "-T0", "-c", NULL }, "zstd -dc" },
+		{ { "pigz", "-9", "-c", NULL }                , "gzip -dc" },
+		{ { "gzip", "-9", "-c", NULL }                , "gzip -dc" },
+	};
+
+	char **tar_argv = calloc(files_cnt + 5, sizeof(char *));
+	if (tar_argv == NULL) {
+		abort();
+	}
+	tar_argv[0] = "tar";
+	tar_argv[1] = "-cf";
+	tar_argv[2] = "-";
+	tar_argv[3] = "--";
+	memcpy(tar_argv + 4, files, files_cnt * sizeof(char *));
+
+	int tar_pipe[2] = {-1, -1};
+	int comp_pipe[2] = {-1, -1};
+	pid_t tar_pid = -1;
+	pid_t comp_pid = -1;
+	size_t comp = 0;
+	int rc = ERR_GENERAL;
+
+	if (pipe_cloexec(tar_pipe) < 0 || pipe_cloexec(comp_pipe) < 0) {
+		logerr("Failed to create pipe: %s", strerror(errno));
+		goto done;
+	}
+	for (comp = 0; comp < sizeof(compressors) / sizeof(*compressors); comp++) {
+		if ((comp_pid = spawn(compressors[comp].compress, tar_pipe[0], comp_pipe[1], -1)) > 0) {
+			break;
+		}
+	}
+	if (comp_pid < 0) {
+		logerr("%s", "Failed to execute zstd, pigz, or gzip");
+		goto done;
+	}
+	if ((tar_pid = spawn(tar_argv, -1, tar_pipe[1], -1)) < 0) {
+		logerr("Failed to execute tar: %s", strerror(errno));
+		goto done;
+	}
+	close(tar_pipe[0]);
+	close(tar_pipe[1]);
+	close(comp_pipe[1]);
+	tar_pipe[0] = tar_pipe[1] = comp_pipe[1] = -1;
+
+	struct buffer archive = {0};
+	ssize_t len = 0;
+	do {
+		buffer_reserve(&archive, READ_BUF_SIZE);
+		if ((len = read(comp_pipe[0], archive.data + archive.len, READ_BUF_SIZE)) > 0) {
+			archive.len += len;
+		}
+	} while (len > 0 || (len < 0 && errno == EINTR));
+
+	if (wait_child(tar_pid) != 0 || wait_child(comp_pid) != 0) {
+		logerr("%s", "Failed to create the bundle");
+		free(archive.data);
+		goto done;
+	}
+	tar_pid = comp_pid = -1;
+
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "base64 -d <<'EOF' | %s | tar -xvf -\n",
+	                          compressors[comp].decompress);
+	buffer_append(out, header, header_len);
+
+	// Wrap base64 lines at 76 characters (57 input bytes).
+	for (size_t i = 0; i < archive.len; i += 57) {
+		size_t n = archive.len - i < 57 ? archive.len - i : 57;
+		buffer_reserve(out, base64_encoded_size(n) + 1);
+		out->len += base64_encode(archive.data + i, n, out->data + out->len, out->cap - out->len);
+		out->data[out->len++] = '\n';
+	}
+	buffer_append(out, "EOF\n", 4);
+	free(archive.data);
+	rc = 0;
+
+done:
+	for (int i = 0; i < 2; i++) {
+		if (tar_pipe[i] >= 0) {
+			close(tar_pipe[i]);
+		}
+		if (comp_pipe[i] >= 0) {
+			close(comp_pipe[i]);
+		}
+	}
+	if (tar_pid > 0) {
+		wait_child(tar_pid);
+	}
+	if (comp_pid > 0) {
+		wait_child(comp_pid);
+	}
+	free(tar_argv);
+
+	return rc;
+}
+
+// The terminal device and the OSC 52 sequence framing.
+static struct {
+	FILE *file;
+	int fd;
+	struct termios restore;
+	char seq_start[32];
+	const char *seq_end;
+} tty = { .fd = -1 };
+
+/**
+ * Initializes the OSC 52 sequence framing according to the options.
+ */
+static void tty_init_seq (void) {
+	sprintf(tty.seq_start, "%s\033]52;%c;",
+		opts.is_tmux ? "\033Ptmux;\033" : "",
+		opts.primary ? 'p' : 'c');
+
+	tty.seq_end = opts.is_tmux ? "\a\033\\" : "\a";
+}
+
+/**
+ * Opens the terminal device `opts.tty_path` (if not opened yet) and, if we are
+ * going to read the terminal's response (--test or --sync), disables echo and
+ * canonical mode. Returns 0 on success, or -1 on error.
+ */
+static int tty_open (void) {
+	if (tty.file != NULL) {
+		return 0;
+	}
+	if ((tty.file = fopen(opts.tty_path, "r+")) == NULL) {
+		logerr("Failed to open %s: %s", opts.tty_path, strerror(errno));
+		return -1;
+	}
+	tty.fd = fileno(tty.file);
+	// Don't leak it to helper commands.
+	fcntl(tty.fd, F_SETFD, FD_CLOEXEC);
+
+	if (isatty(tty.fd) && (opts.op == OP_TEST || opts.sync)) {
+		// Save the current terminal state so we can restore it later.
+		tcgetattr(tty.fd, &tty.restore);
+		// Avoid mixing input with terminal output.
+		term_change_local_modes(tty.fd, ~(CREAD | ECHO | ICANON));
+	}
+	return 0;
+}
+
+/**
+ * Restores the terminal state and closes the terminal device, if opened.
+ */
+static void tty_close (void) {
+	if (tty.file == NULL) {
+		return;
+	}
+	if (isatty(tty.fd) && (opts.op == OP_TEST || opts.sync)) {
+		tcsetattr(tty.fd, TCSANOW, &tty.restore);
+	}
+	fclose(tty.file);
+	tty.file = NULL;
+}
+
+/**
+ * A sink that writes the data to stdin of a helper command.
+ */
+struct cmd_writer {
+	struct sink sink;
+	pid_t pid;
+	int fd;
+};
+
+static int cmd_writer_write (struct sink *self, const uchar *data, size_t len) {
+	struct cmd_writer *w = (struct cmd_writer *) self;
+
+	return write_all(w->fd, data, len) < 0 ? ERR_IO : 0;
+}
+
+static int cmd_writer_close (struct sink *self) {
+	struct cmd_writer *w = (struct cmd_writer *) self;
+
+	close(w->fd);
+	return wait_child(w->pid) == 0 ? 0 : ERR_GENERAL;
+}
+
+/**
+ * Spawns the command `argv` and initializes `w` to write to its stdin.
+ * The command's output is discarded; so are its error messages if there's
+ * a fallback backend.
+ *
+ * @return 0 on success, or an exit code on error.
+ */
+static int cmd_writer_open (struct cmd_writer *w, char * const *argv) {
+	int fds[2];
+	int null_fd = -1;
+
+	if (pipe_cloexec(fds) < 0) {
+		return ERR_GENERAL;
+	}
+	null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	w->pid = spawn(argv, fds[0], null_fd, opts.backend == NULL ? null_fd : -1);
+	close(fds[0]);
+	close(null_fd);
+
+	if (w->pid < 0) {
+		if (opts.backend != NULL) {
+			logerr("Failed to execute %s: %s", argv[0], strerror(errno));
+		}
+		close(fds[1]);
+		return ERR_GENERAL;
+	}
+	w->sink = (struct sink) { .write = cmd_writer_write, .close = cmd_writer_close };
+	w->fd = fds[1];
+
+	return 0;
+}
+
+/**
+ * A way of delivering the data to the clipboard.
+ */
+struct backend {
+	const char *name;
+	// Returns true if the backend should be tried in the "auto" mode.
+	// If NULL, the backend is used only if requested by --backend.
+	bool (*detect) (void);
+	// Starts the backend and sets `*out` to the sink that accepts the data.
+	// Returns 0 on success, or an exit code on error.
+	int (*open) (struct sink **out);
+	// Maximum size of the data the backend accepts, or 0 if not limited.
+	size_t max_size;
+	// If true, the backend is used only if no preceding backend could be
+	// opened, not when it fails later (e.g. on --sync timeout).
+	bool last_resort;
+};
+
+// Header of the --socket protocol: magic, version, flags, and 2 reserved
+// bytes. It's followed by the raw data until the client shuts down writing,
+// then the listener responds with a single byte: the exit code.
+#define SOCKET_MAGIC "TTYC"
+#define SOCKET_VERSION 1
+#define SOCKET_HEADER_SIZE 8
+#define SOCKET_FLAG_PRIMARY 0x01
+
+// How long to wait for the other side of the --socket connection. It must be
+// longer than SYNC_TIMEOUT_MS, since the listener may wait for its terminal.
+#define SOCKET_TIMEOUT_MS (SYNC_TIMEOUT_MS + 5000)
+
+/**
+ * Sets the send and receive timeout of the socket `fd` to SOCKET_TIMEOUT_MS,
+ * so that a stuck peer cannot block us forever.
+ */
+static void socket_set_timeout (int fd) {
+	struct timeval tv = {
+		.tv_sec = SOCKET_TIMEOUT_MS / 1000,
+		.tv_usec = (SOCKET_TIMEOUT_MS % 1000) * 1000,
+	};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Fills the Unix socket address `addr` with the `path`. Returns 0 on success,
+ * or -1 if the path is too long.
+ */
+static int socket_addr (struct sockaddr_un *addr, const char *path) {
+	*addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		logerr("Socket path is too long: %s", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+/**
+ * A sink that sends the data to tty-copy --listen over a Unix socket.
+ */
+struct socket_writer {
+	struct sink sink;
+	int fd;
+};
+
+static int socket_writer_write (struct sink *self, const uchar *data, size_t len) {
+	struct socket_writer *w = (struct socket_writer *) self;
+
+	return write_all(w->fd, data, len) < 0 ? ERR_IO : 0;
+}
+
+static int socket_writer_close (struct sink *self) {
+	struct socket_writer *w = (struct socket_writer *) self;
+	uchar status = ERR_IO;
+
+	// Wait for the listener to copy the data.
+	if (shutdown(w->fd, SHUT_WR) < 0 || read(w->fd, &status, 1) != 1) {
+		status = ERR_IO;
+	}
+	close(w->fd);
+
+	return status;
+}
+
+static bool socket_detect (void) {
+	return opts.socket_path != NULL;
+}
+
+/**
+ * Connects to tty-copy --listen on the socket `opts.socket_path`.
+ */
+static int socket_open (struct sink **out) {
+	static struct socket_writer writer;
+	struct sockaddr_un addr;
+
+	if (opts.socket_path == NULL) {
+		logerr("%s", "No socket specified, use --socket");
+		return ERR_WRONG_USAGE;
+	}
+	if (socket_addr(&addr, opts.socket_path) < 0) {
+		return ERR_WRONG_USAGE;
+	}
+	if ((writer.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return ERR_IO;
+	}
+	fcntl(writer.fd, F_SETFD, FD_CLOEXEC);
+	socket_set_timeout(writer.fd);
+
+	uchar header[SOCKET_HEADER_SIZE] = SOCKET_MAGIC;
+	header[4] = SOCKET_VERSION;
+	header[5] = opts.primary ? SOCKET_FLAG_PRIMARY : 0;
+
+	if (connect(writer.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| write_all(writer.fd, header, sizeof(header)) < 0) {
+		if (opts.backend != NULL) {
+			logerr("Failed to connect to %s: %s", opts.socket_path, strerror(errno));
+		}
+		close(writer.fd);
+		return ERR_IO;
+	}
+	writer.sink = (struct sink) { .write = socket_writer_write, .close = socket_writer_close };
+	*out = &writer.sink;
+
+	return 0;
+}
+
+static bool wayland_detect (void) {
+	return getenv("WAYLAND_DISPLAY") != NULL;
+}
+
+/**
+ * Copies the data to the local Wayland clipboard using wl-copy.
+ */
+static int wayland_open (struct sink **out) {
+	static char *argv[] = { "wl-copy", NULL, NULL };
+	static struct cmd_writer writer;
+	int rc = 0;
+
+	argv[1] = opts.primary ? "--primary" : NULL;
+	if ((rc = cmd_writer_open(&writer, argv)) == 0) {
+		*out = &writer.sink;
+	}
+	return rc;
+}
+
+static bool x11_detect (void) {
+	return getenv("DISPLAY") != NULL;
+}
+
+/**
+ * Copies the data to the local X11 clipboard using xclip, or xsel if xclip
+ * is not available.
+ */
+static int x11_open (struct sink **out) {
+	char *xclip_argv[] = { "xclip", "-in", "-selection", opts.primary ? "primary" : "clipboard", NULL };
+	char *xsel_argv[] = { "xsel", "--input", opts.primary ? "--primary" : "--clipboard", NULL };
+	static struct cmd_writer writer;
+	int rc = 0;
+
+	if ((rc = cmd_writer_open(&writer, xclip_argv)) != 0
+			&& (rc = cmd_writer_open(&writer, xsel_argv)) != 0) {
+		return rc;
+	}
+	*out = &writer.sink;
+
+	return 0;
+}
+
+static bool tmux_detect (void) {
+	// tmux doesn't allow to choose the selection.
+	return opts.is_tmux && !opts.primary && getenv("TMUX") != NULL;
+}
+
+/**
+ * Loads the data into a tmux paste buffer and lets tmux send it to the outer
+ * terminal itself (if the set-clipboard option is enabled). Unlike passthrough,
+ * this works for any size and doesn't need allow-passthrough. The -w flag
+ * requires tmux 3.2 or newer.
+ */
+static int tmux_open (struct sink **out) {
+	static char *argv[] = { "tmux", "load-buffer", "-w", "-", NULL };
+	static struct cmd_writer writer;
+	int rc = 0;
+
+	if ((rc = cmd_writer_open(&writer, argv)) == 0) {
+		*out = &writer.sink;
+	}
+	return rc;
+}
+
+/**
+ * A sink that writes the data to a private temporary file and loads it into
+ * the screen paste buffer on close.
+ */
+struct screen_writer {
+	struct sink sink;
+	int fd;
+	char *path;
+};
+
+static int screen_writer_write (struct sink *self, const uchar *data, size_t len) {
+	struct screen_writer *w = (struct screen_writer *) self;
+
+	return write_all(w->fd, data, len) < 0 ? ERR_IO : 0;
+}
+
+static int screen_writer_close (struct sink *self) {
+	struct screen_writer *w = (struct screen_writer *) self;
+	char *readbuf_argv[] = { "screen", "-X", "readbuf", w->path, NULL };
+	// screen -X doesn't wait for the command to be executed, but the session
+	// processes messages in order, so a query is used as a barrier before
+	// removing the file. -Q is supported since screen 4.1.
+	char *barrier_argv[] = { "screen", "-Q", "number", NULL };
+	int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	int rc = ERR_IO;
+	pid_t pid = -1;
+
+	if (close(w->fd) == 0) {
+		rc = (pid = spawn(readbuf_argv, -1, null_fd, -1)) > 0 && wait_child(pid) == 0
+			? 0 : ERR_GENERAL;
+	}
+	if (rc == 0 && ((pid = spawn(barrier_argv, -1, null_fd, null_fd)) < 0 || wait_child(pid) != 0)) {
+		// screen older than 4.1, give it a while.
+		nanosleep(&(struct timespec) { .tv_nsec = 200000000 }, NULL);
+	}
+	close(null_fd);
+	unlink(w->path);
+	free(w->path);
+
+	return rc;
+}
+
+/**
+ * Loads the data into the screen paste buffer via `screen -X readbuf`.
+ * Unlike the passthrough, this is not limited in size, but screen cannot
+ * forward its paste buffer to the outer terminal, so it's used only if
+ * requested by --backend.
+ */
+static int screen_open (struct sink **out) {
+	static struct screen_writer writer;
+	const char *tmpdir = getenv("TMPDIR");
+
+	if (getenv("STY") == NULL) {
+		logerr("%s", "Not running inside screen");
+		return ERR_GENERAL;
+	}
+	if (tmpdir == NULL || *tmpdir == '\0') {
+		tmpdir = "/tmp";
+	}
+	size_t path_size = strlen(tmpdir) + sizeof("/" PROGNAME ".XXXXXX");
+	if ((writer.path = malloc(path_size)) == NULL) {
+		abort();
+	}
+	snprintf(writer.path, path_size, "%s/" PROGNAME ".XXXXXX", tmpdir);
+
+	// mkstemp creates the file with mode 0600.
+	if ((writer.fd = mkstemp(writer.path)) < 0) {
+		logerr("Failed to create temporary file %s: %s", writer.path, strerror(errno));
+		free(writer.path);
+		return ERR_IO;
+	}
+	fcntl(writer.fd, F_SETFD, FD_CLOEXEC);
+
+	writer.sink = (struct sink) { .write = screen_writer_write, .close = screen_writer_close };
+	*out = &writer.sink;
+
+	return 0;
+}
+
+static bool tty_detect (void) {
+	return true;
+}
+
+/**
+ * Writes the data to the terminal in OSC 52 sequence, wrapped in the tmux or
+ * screen passthrough if needed.
+ */
+static int tty_backend_open (struct sink **out) {
+	static struct osc_writer writer;
+
+	if (tty_open() < 0) {
+		return ERR_IO;
+	}
+	// Screen limits the length of string sequences, so we have to break it
+	// up to chunks of max 768 bytes.
+	// 2048 * 3 bytes for others is just an arbitrary number.
+	// IMPORTANT: The chunk size must be divisable by 3 (because of base64)!
+	size_t chunk_size = opts.chunk_size >= 3
+		? opts.chunk_size / 3 * 3
+		: (opts.is_screen ? 254 : 2048) * 3;
+
+	osc_writer_init(&writer, tty.file, tty.seq_start, tty.seq_end, chunk_size);
+	*out = &writer.sink;
+
+	return 0;
+}
+
+/**
+ * The local clipboard ring: a fixed number of slots in a shared memory
+ * object, which all tty-copy processes of the user on the host can write to
+ * and read from without locking. Each slot has a sequence number derived
+ * from the number of the entry, so a writer never waits for another one (that
+ * might have died in the middle of writing) and a newer entry always wins.
+ *
+ * An older writer that has been preempted right after checking that it still
+ * owns the slot can overwrite a part of a newer entry, which cannot be
+ * prevented without waiting. Such an entry doesn't match its checksum, so
+ * the reader never returns it.
+ */
+struct ring_slot {
+	// 2 * id - 1 while the entry `id` is being written, 2 * id when it's
+	// complete, 0 if the slot is empty.
+	atomic_uint_least64_t seq;
+	atomic_uint_least64_t len;
+	atomic_uint_least64_t checksum;
+	uchar data[RING_SLOT_SIZE];
+};
+
+struct ring {
+	atomic_uint_least32_t magic;
+	atomic_uint_least64_t head;  // number of entries ever written
+	struct ring_slot slots[RING_SLOTS];
+};
+
+/**
+ * Opens (and creates if `writable`) the local clipboard ring of the current
+ * user and maps it into memory.
+ *
+ * @return The mapped ring, or NULL on error (with message logged).
+ */
+static struct ring *ring_open (bool writable) {
+	char name[32];
+	struct stat st;
+	struct ring *ring = NULL;
+	int fd = -1;
+
+	// The ring is private to the user.
+	snprintf(name, sizeof(name), "/" PROGNAME "-%lu", (unsigned long) getuid());
+
+	if ((fd = shm_open(name, writable ? O_RDWR | O_CREAT : O_RDONLY, 0600)) < 0) {
+		if (writable || errno != ENOENT) {
+			logerr("Failed to open shared memory %s: %s", name, strerror(errno));
+		} else {
+			logerr("%s", "Local clipboard ring is empty");
+		}
+		return NULL;
+	}
+	// If another process has just created it, ftruncate may fail on some
+	// systems, so check the size again.
+	if (fstat(fd, &st) == 0 && st.st_size == 0 && writable) {
+		(void) ftruncate(fd, sizeof(struct ring));
+		fstat(fd, &st);
+	}
+	if (st.st_size != sizeof(struct ring)) {
+		logerr("Shared memory %s has unexpected size", name);
+		close(fd);
+		return NULL;
+	}
+	ring = mmap(NULL, sizeof(*ring), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (ring == MAP_FAILED) {
+		logerr("Failed to map shared memory %s: %s", name, strerror(errno));
+		return NULL;
+	}
+	// A new object is zero-filled, i.e. all slots are empty.
+	uint_least32_t magic = 0;
+	if (writable) {
+		atomic_compare_exchange_strong(&ring->magic, &magic, RING_MAGIC);
+	} else {
+		magic = atomic_load(&ring->magic);
+	}
+	if (magic != 0 && magic != RING_MAGIC) {
+		logerr("Shared memory %s has incompatible format", name);
+		munmap(ring, sizeof(*ring));
+		return NULL;
+	}
+	return ring;
+}
+
+/**
+ * Returns the checksum (64-bit FNV-1a) of the `data` of the length `len`.
+ */
+static uint64_t ring_checksum (const uchar *data, size_t len) {
+	uint64_t h = 14695981039346656037u;
+
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ data[i]) * 1099511628211u;
+	}
+	return h ^ len;
+}
+
+/**
+ * Stores the `data` as a new entry in the `ring`, overwriting the oldest one.
+ */
+static void ring_push (struct ring *ring, const uchar *data, size_t len) {
+	assert(len <= RING_SLOT_SIZE && "data too large for ring slot");
+
+	uint_least64_t id = atomic_fetch_add(&ring->head, 1) + 1;
+	struct ring_slot *slot = &ring->slots[(id - 1) % RING_SLOTS];
+	uint_least64_t claim = 2 * id - 1;
+
+	// Claim the slot, superseding an older entry even if it's still being
+	// written. If a newer entry has already claimed it, ours is obsolete.
+	uint_least64_t seq = atomic_load(&slot->seq);
+	do {
+		if (seq >= claim) {
+			return;
+		}
+	} while (!atomic_compare_exchange_weak(&slot->seq, &seq, claim));
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&slot->len, len, memory_order_relaxed);
+	atomic_store_explicit(&slot->checksum, ring_checksum(data, len), memory_order_relaxed);
+
+	bool written = false;
+	for (size_t off = 0; off < len; off += RING_COPY_CHUNK) {
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != claim) {
+			break;
+		}
+		memcpy(slot->data + off, data + off, len - off < RING_COPY_CHUNK ? len - off : RING_COPY_CHUNK);
+		written = true;
+	}
+
+	seq = claim;
+	if (atomic_compare_exchange_strong_explicit(&slot->seq, &seq, claim + 1,
+			memory_order_release, memory_order_relaxed) || !written) {
+		return;
+	}
+	// A newer writer has claimed the slot meanwhile and we might have
+	// overwritten a part of its data. Set the sequence to an odd number that
+	// doesn't belong to any entry of this slot, so the newer entry is never
+	// read, and the next writer supersedes it.
+	while (!atomic_compare_exchange_weak(&slot->seq, &seq, (seq | 1) + 2)) {
+	}
+}
+
+/**
+ * Copies the entry `n` (1 = the most recent) from the `ring` into the buffer
+ * `out`. Returns 0 on success, -1 if there's no such entry, or it's still
+ * being written after a number of retries (its writer may have died).
+ */
+static int ring_get (struct ring *ring, size_t n, struct buffer *out) {
+	uint_least64_t head = atomic_load(&ring->head);
+
+	if (n < 1 || n > RING_SLOTS || n > head) {
+		return -1;
+	}
+	uint_least64_t id = head - n + 1;
+	struct ring_slot *slot = &ring->slots[(id - 1) % RING_SLOTS];
+
+	for (int i = 0; i < RING_READ_RETRIES; i++) {
+		uint_least64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq > 2 * id) {
+			return -1;  // overwritten meanwhile
+		}
+		if (seq < 2 * id) {
+			sched_yield();
+			continue;
+		}
+		size_t len = atomic_load_explicit(&slot->len, memory_order_relaxed);
+		uint64_t checksum = atomic_load_explicit(&slot->checksum, memory_order_relaxed);
+		if (len > RING_SLOT_SIZE) {
+			len = RING_SLOT_SIZE;
+		}
+		out->len = 0;
+		buffer_append(out, slot->data, len);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq
+				&& ring_checksum(out->data, out->len) == checksum) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * A sink that collects the data and stores it in the local clipboard ring
+ * on close.
+ */
+struct ring_writer {
+	struct sink sink;
+	struct ring *ring;
+	struct buffer data;
+	bool too_large;
+};
+
+static int ring_writer_write (struct sink *self, const uchar *data, size_t len) {
+	struct ring_writer *w = (struct ring_writer *) self;
+
+	if (w->data.len + len > RING_SLOT_SIZE) {
+		w->too_large = true;
+	} else {
+		buffer_append(&w->data, data, len);
+	}
+	return 0;
+}
+
+static int ring_writer_close (struct sink *self) {
+	struct ring_writer *w = (struct ring_writer *) self;
+	int rc = 0;
+
+	if (w->too_large) {
+		logerr("Data is too large for the local clipboard ring (limit is %d kiB)",
+			RING_SLOT_SIZE / 1024);
+		rc = ERR_GENERAL;
+	} else {
+		ring_push(w->ring, w->data.data, w->data.len);
+	}
+	munmap(w->ring, sizeof(*w->ring));
+	free(w->data.data);
+
+	return rc;
+}
+
+static bool local_detect (void) {
+	// If the terminal was given explicitly, failing to open it is an error.
+	return !opts.tty_path_given;
+}
+
+/**
+ * Stores the data in the local clipboard ring, from which it can be pasted
+ * by tty-copy --paste-local in any session of the user on this host. It's the
+ * last resort if neither the clipboard nor the terminal can be opened.
+ */
+static int local_open (struct sink **out) {
+	static struct ring_writer writer;
+
+	writer = (struct ring_writer) {
+		.sink = { .write = ring_writer_write, .close = ring_writer_close },
+	};
+	if ((writer.ring = ring_open(true)) == NULL) {
+		return ERR_IO;
+	}
+	// In the auto mode, we get here only if no other backend could be opened.
+	if (opts.backend == NULL) {
+		logerr("%s", "Copying to the local clipboard ring instead, paste it with tty-copy --paste-local");
+	}
+	*out = &writer.sink;
+
+	return 0;
+}
+
+// Backends in the order in which they are tried in the "auto" mode.
+static const struct backend backends[] = {
+	{ "socket" , socket_detect , socket_open     , 0             , false },
+	{ "wayland", wayland_detect, wayland_open    , 0             , false },
+	{ "x11"    , x11_detect    , x11_open        , 0             , false },
+	{ "tmux"   , tmux_detect   , tmux_open       , 0             , false },
+	{ "screen" , NULL          , screen_open     , 0             , false },
+	{ "tty"    , tty_detect    , tty_backend_open, 0             , false },
+	{ "local"  , local_detect  , local_open      , RING_SLOT_SIZE, true  },
+};
+
+#define BACKENDS_CNT (sizeof(backends) / sizeof(*backends))
+
+/**
+ * Returns the backend with the given `name`, or NULL if there's no such.
+ */
+static const struct backend *backend_find (const char *name) {
+	for (size_t i = 0; i < BACKENDS_CNT; i++) {
+		if (str_equal(backends[i].name, name)) {
+			return &backends[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * The final stage of the pipeline that passes the data to the first backend
+ * that works. If the backend fails, the next one gets all the data from the
+ * beginning, so the data must be kept in memory until the last backend is
+ * reached.
+ */
+struct backend_chain {
+	struct sink sink;
+	const struct backend *backends[BACKENDS_CNT];
+	int cnt;
+	int idx;
+	struct sink *out;    // sink of the current backend
+	struct buffer data;  // data written so far, if there's a fallback
+	size_t total;        // number of bytes written so far
+};
+
+/**
+ * Switches to the next backend that can be opened and replays the data
+ * written so far to it. Returns 0 on success, or an exit code of the last
+ * failure.
+ */
+static int backend_chain_next (struct backend_chain *c) {
+	int rc = ERR_GENERAL;
+
+	while (++c->idx < c->cnt) {
+		if ((rc = c->backends[c->idx]->open(&c->out)) != 0) {
+			continue;
+		}
+		while (c->cnt - 1 > c->idx && c->backends[c->cnt - 1]->last_resort) {
+			c->cnt--;
+		}
+		if (c->data.len == 0 || (rc = c->out->write(c->out, c->data.data, c->data.len)) == 0) {
+			if (c->idx == c->cnt - 1) {
+				free(c->data.data);
+				c->data = (struct buffer) {0};
+			}
+			return 0;
+		}
+		c->out->close(c->out);
+	}
+	c->out = NULL;
+
+	return rc;
+}
+
+static int backend_chain_write (struct sink *self, const uchar *data, size_t len) {
+	struct backend_chain *c = (struct backend_chain *) self;
+	int rc = 0;
+
+	if (c->out == NULL) {
+		return ERR_GENERAL;
+	}
+	c->total += len;
+
+	if (c->idx < c->cnt - 1) {
+		// Don't keep more data in memory for the fallbacks than a small
+		// multiple of what the terminal can take without truncating.
+		if (c->data.len + len > 4 * opts.payload_limit) {
+			c->cnt = c->idx + 1;
+		} else {
+			buffer_append(&c->data, data, len);
+		}
+		// Drop the fallbacks at the end that cannot accept that much data.
+		const struct backend *last = NULL;
+		while (c->idx < c->cnt - 1 && (last = c->backends[c->cnt - 1])->max_size > 0
+				&& c->data.len > last->max_size) {
+			c->cnt--;
+		}
+		if (c->idx == c->cnt - 1) {
+			free(c->data.data);
+			c->data = (struct buffer) {0};
+		}
+	}
+	if ((rc = c->out->write(c->out, data, len)) != 0) {
+		c->out->close(c->out);
+		rc = backend_chain_next(c);
+	}
+	return rc;
+}
+
+static int backend_chain_close (struct sink *self) {
+	struct backend_chain *c = (struct backend_chain *) self;
+	int rc = ERR_GENERAL;
+
+	while (c->out != NULL && (rc = c->out->close(c->out)) != 0) {
+		backend_chain_next(c);
+	}
+	free(c->data.data);
+
+	return rc;
+}
+
+/**
+ * Initializes the backend chain `c` with the backend specified by --backend,
+ * or all detected backends. No backend is opened until backend_chain_open.
+ */
+static void backend_chain_init (struct backend_chain *c) {
+	*c = (struct backend_chain) {
+		.sink = { .write = backend_chain_write, .close = backend_chain_close },
+		.idx = -1,
+	};
+	if (opts.backend != NULL) {
+		c->backends[c->cnt++] = backend_find(opts.backend);
+	} else {
+		// An explicitly given terminal takes precedence over the clipboard.
+		const struct backend *b = opts.tty_path_given ? backend_find("tty") : backends;
+
+		for (; b < backends + BACKENDS_CNT; b++) {
+			if (b->detect != NULL && b->detect()) {
+				c->backends[c->cnt++] = b;
+			}
+		}
+	}
+}
+
+/**
+ * Removes the backend `name`, and the last resort backends that follow it,
+ * from the chain `c` that hasn't been opened yet.
+ */
+static void backend_chain_drop (struct backend_chain *c, const char *name) {
+	int n = 0;
+	bool dropped = false;
+
+	for (int i = 0; i < c->cnt; i++) {
+		if (str_equal(c->backends[i]->name, name)) {
+			dropped = true;
+		} else if (!dropped || !c->backends[i]->last_resort) {
+			c->backends[n++] = c->backends[i];
+		}
+	}
+	c->cnt = n;
+}
+
+/**
+ * Opens the first backend of the chain `c` that works.
+ *
+ * @return 0 on success, or an exit code on error.
+ */
+static int backend_chain_open (struct backend_chain *c) {
+	return backend_chain_next(c);
+}
+
+/**
+ * Counters aggregated over all runs, in a file mapped into memory by every
+ * tty-copy process.
+ */
+struct metrics {
+	atomic_uint_least32_t magic;
+	atomic_uint_least64_t copies;
+	atomic_uint_least64_t bytes;
+	atomic_uint_least64_t truncation_warnings;
+	atomic_uint_least64_t io_errors;
+	atomic_uint_least64_t duration_sum_us;
+	atomic_uint_least64_t duration_buckets[METRICS_BUCKETS + 1];  // the last is +Inf
+};
+
+/**
+ * Opens (and creates if `writable`) the metrics file and maps it into memory.
+ * The host-wide /run/tty-copy.metrics is used if it exists (it must be
+ * created by the administrator), otherwise $XDG_RUNTIME_DIR/tty-copy.metrics.
+ *
+ * Anyone who can write to the file can also truncate it, which crashes all
+ * processes that have it mapped with SIGBUS, so the host-wide file is
+ * ignored if it's writable by others.
+ *
+ * @return The mapped metrics, or NULL on error.
+ */
+static struct metrics *metrics_open (bool writable) {
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	char path[4096] = "/run/" METRICS_FILENAME;
+	struct metrics *m = NULL;
+	struct stat st;
+	int fd = -1;
+
+	fd = open(path, writable ? O_RDWR | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 && (fstat(fd, &st) < 0 || (st.st_mode & S_IWOTH))) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		if (runtime_dir == NULL || *runtime_dir == '\0') {
+			return NULL;
+		}
+		snprintf(path, sizeof(path), "%s/" METRICS_FILENAME, runtime_dir);
+		fd = open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0600);
+	}
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size == 0 && writable) {
+		(void) ftruncate(fd, sizeof(struct metrics));
+		fstat(fd, &st);
+	}
+	if (st.st_size == sizeof(struct metrics)) {
+		m = mmap(NULL, sizeof(*m), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+
+	if (m == NULL || m == MAP_FAILED) {
+		return NULL;
+	}
+	// A new file is zero-filled, i.e. all counters are 0.
+	uint_least32_t magic = 0;
+	if (writable) {
+		atomic_compare_exchange_strong(&m->magic, &magic, METRICS_MAGIC);
+	} else {
+		magic = atomic_load(&m->magic);
+	}
+	if (magic != 0 && magic != METRICS_MAGIC) {
+		munmap(m, sizeof(*m));
+		return NULL;
+	}
+	return m;
+}
+
+/**
+ * Records the result of a copy operation in the metrics file. Metrics are
+ * best effort, errors are ignored.
+ *
+ * @param rc Exit code of the copy operation.
+ * @param bytes Number of bytes copied.
+ * @param duration_ms Duration of the copy operation.
+ */
+static void metrics_record (int rc, size_t bytes, double duration_ms) {
+	struct metrics *m = NULL;
+
+	if ((m = metrics_open(true)) == NULL) {
+		return;
+	}
+	uint_least64_t us = duration_ms > 0 ? (uint_least64_t)(duration_ms * 1000) : 0;
+	int bucket = 0;
+	while (bucket < METRICS_BUCKETS && us > (1ULL << (bucket + 7))) {
+		bucket++;
+	}
+
+	if (rc == 0) {
+		atomic_fetch_add(&m->copies, 1);
+		atomic_fetch_add(&m->bytes, bytes);
+	} else if (rc == ERR_IO) {
+		atomic_fetch_add(&m->io_errors, 1);
+	}
+	if (truncation_warned) {
+		atomic_fetch_add(&m->truncation_warnings, 1);
+		truncation_warned = false;
+	}
+	atomic_fetch_add(&m->duration_sum_us, us);
+	atomic_fetch_add(&m->duration_buckets[bucket], 1);
+
+	munmap(m, sizeof(*m));
+}
+
+/**
+ * Prints the metrics in the Prometheus text exposition format to stdout.
+ *
+ * @return Exit code.
+ */
+static int metrics_print (void) {
+	struct metrics *m = NULL;
+
+	if ((m = metrics_open(false)) == NULL) {
+		logerr("%s", "No metrics recorded yet");
+		return ERR_GENERAL;
+	}
+	const struct { const char *name; const char *help; atomic_uint_least64_t *value; } counters[] = {
+		{ "copies_total", "Number of successful copy operations.", &m->copies },
+		{ "bytes_total", "Number of bytes copied.", &m->bytes },
+		{ "truncation_warnings_total", "Number of copies larger than the safe OSC 52 limit.", &m->truncation_warnings },
+		{ "io_errors_total", "Number of copy operations failed on I/O error.", &m->io_errors },
+	};
+	for (size_t i = 0; i < sizeof(counters) / sizeof(*counters); i++) {
+		printf("# HELP tty_copy_%s %s\n", counters[i].name, counters[i].help);
+		printf("# TYPE tty_copy_%s counter\n", counters[i].name);
+		printf("tty_copy_%s %llu\n", counters[i].name,
+			(unsigned long long) atomic_load(counters[i].value));
+	}
+
+	printf("# HELP tty_copy_duration_seconds Duration of copy operations.\n");
+	printf("# TYPE tty_copy_duration_seconds histogram\n");
+
+	unsigned long long count = 0;
+	for (int i = 0; i <= METRICS_BUCKETS; i++) {
+		count += atomic_load(&m->duration_buckets[i]);
+		if (i < METRICS_BUCKETS) {
+			printf("tty_copy_duration_seconds_bucket{le=\"%.6f\"} %llu\n",
+				(1ULL << (i + 7)) / 1e6, count);
+		} else {
+			printf("tty_copy_duration_seconds_bucket{le=\"+Inf\"} %llu\n", count);
+		}
+	}
+	printf("tty_copy_duration_seconds_sum %.6f\n", atomic_load(&m->duration_sum_us) / 1e6);
+	printf("tty_copy_duration_seconds_count %llu\n", count);
+
+	munmap(m, sizeof(*m));
+
+	return fflush(stdout) == 0 ? EXIT_SUCCESS : ERR_IO;
+}
+
+/**
+ * Terminal profiles allow to override the backend and the framing
+ * parameters based on TERM, TERM_PROGRAM, and the terminal multiplexer.
+ * They are defined in a text file, one profile per line:
+ *
+ *   # selector          settings...
+ *   term=xterm-kitty    limit=8388608
+ *   term_program=iTerm.app  limit=1048576
+ *   mux=screen          chunk=762 pacing=1000
+ *
+ * The selector is "term=", "term_program=", or "mux=" (tmux or screen)
+ * followed by the exact value. The settings are "backend", "chunk" (bytes of
+ * input per chunk), "limit" (payload limit in bytes), and "pacing" (delay
+ * between chunks in microseconds). If more profiles match, settings of
+ * the "mux" profile take precedence over "term_program", and that over "term".
+ *
+ * To keep startup cheap, the text file is compiled on first use (and after
+ * every modification) into a binary cache that is mapped into memory and
+ * looked up using a perfect hash.
+ */
+struct profile {
+	char *selector;
+	char *backend;      // NULL if not set
+	long chunk_size;    // -1 if not set
+	long limit;         // -1 if not set
+	long pacing_us;     // -1 if not set
+};
+
+// Header of the compiled profiles. It's followed by the hash table of
+// `table_size` uint32_t entry indexes (+1, 0 is empty), `entries_cnt` entries,
+// and the string pool.
+struct profiles_header {
+	uint32_t magic;
+	uint32_t seed;
+	uint32_t table_size;   // power of 2
+	uint32_t entries_cnt;
+	int64_t src_mtime;     // modification time, size, and inode of the text file
+	int64_t src_mtime_nsec;
+	int64_t src_size;
+	uint64_t src_ino;
+};
+
+struct profiles_entry {
+	uint32_t selector_off;  // offset of a null-terminated string in the pool
+	uint32_t backend_off;   // 0 if not set
+	int32_t chunk_size;
+	int32_t limit;
+	int32_t pacing_us;
+};
+
+/**
+ * Hashes the string `str` with the `seed` (FNV-1a with a final mix).
+ */
+static uint32_t profiles_hash (const char *str, uint32_t seed) {
+	uint32_t h = 2166136261u ^ (seed * 0x9E3779B9u);
+
+	for (const uchar *p = (const uchar *) str; *p != '\0'; p++) {
+		h = (h ^ *p) * 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/**
+ * Parses the numeric value of the setting. Returns -1 if it's invalid.
+ */
+static long profiles_parse_num (const char *value) {
+	char *end = NULL;
+	long num = strtol(value, &end, 10);
+
+	return (*value == '\0' || *end != '\0' || num < 0 || num > INT32_MAX) ? -1 : num;
+}
+
+/**
+ * Parses the profiles text file `path` into an array of profiles.
+ * Invalid lines are reported and skipped.
+ *
+ * @return Number of profiles, or -1 if the file cannot be read.
+ */
+static int profiles_parse (const char *path, struct profile **profiles) {
+	FILE *fp = NULL;
+	char *line = NULL;
+	size_t line_cap = 0;
+	int cnt = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	*profiles = NULL;
+
+	for (int lineno = 1; getline(&line, &line_cap, fp) > 0; lineno++) {
+		char *comment = strchr(line, '#');
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+		char *saveptr = NULL;
+		char *token = strtok_r(line, " \t\r\n", &saveptr);
+		if (token == NULL) {
+			continue;
+		}
+		if (!str_startswith(token, "term=") && !str_startswith(token, "term_program=")
+				&& !str_startswith(token, "mux=")) {
+			logerr("%s:%d: invalid selector: %s", path, lineno, token);
+			continue;
+		}
+		// A repeated selector overrides the settings of the previous one.
+		struct profile *prof = NULL;
+		for (int i = 0; i < cnt; i++) {
+			if (str_equal((*profiles)[i].selector, token)) {
+				prof = &(*profiles)[i];
+			}
+		}
+		if (prof == NULL) {
+			if ((*profiles = realloc(*profiles, (cnt + 1) * sizeof(**profiles))) == NULL) {
+				abort();
+			}
+			prof = &(*profiles)[cnt++];
+			*prof = (struct profile) {
+				.selector = strdup(token),
+				.chunk_size = -1,
+				.limit = -1,
+				.pacing_us = -1,
+			};
+		}
+		while ((token = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+			char *value = strchr(token, '=');
+			long num = -1;
+
+			if (value == NULL) {
+				logerr("%s:%d: invalid setting: %s", path, lineno, token);
+				continue;
+			}
+			*value++ = '\0';
+			if (str_equal(token, "backend")) {
+				free(prof->backend);
+				prof->backend = strdup(value);
+				continue;
+			}
+			if ((num = profiles_parse_num(value)) < 0) {
+				logerr("%s:%d: invalid value of %s: %s", path, lineno, token, value);
+			} else if (str_equal(token, "chunk") && num > PROFILES_MAX_CHUNK) {
+				logerr("%s:%d: chunk is too large: %s (max is %d)", path, lineno, value, PROFILES_MAX_CHUNK);
+			} else if (str_equal(token, "chunk")) {
+				prof->chunk_size = num;
+			} else if (str_equal(token, "limit")) {
+				prof->limit = num;
+			} else if (str_equal(token, "pacing")) {
+				prof->pacing_us = num;
+			} else {
+				logerr("%s:%d: unknown setting: %s", path, lineno, token);
+			}
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	return cnt;
+}
+
+/**
+ * Compiles the `profiles` into the binary format in the buffer `out`.
+ */
+static void profiles_compile (const struct profile *profiles, int cnt, const struct stat *src_st,
+                              struct buffer *out) {
+	struct profiles_header header = {
+		.magic = PROFILES_MAGIC,
+		.table_size = 1,
+		.entries_cnt = cnt,
+		.src_mtime = src_st->st_mtime,
+		.src_mtime_nsec = ST_MTIME_NSEC(src_st),
+		.src_size = src_st->st_size,
+		.src_ino = src_st->st_ino,
+	};
+	while (header.table_size < 2 * (uint32_t) cnt) {
+		header.table_size *= 2;
+	}
+
+	// Find a seed for which the hash has no collisions; with the table at
+	// most half full, it takes just a few attempts on average.
+	uint32_t *table = NULL;
+	for (bool found = false; !found; ) {
+		if ((table = realloc(table, header.table_size * sizeof(*table))) == NULL) {
+			abort();
+		}
+		for (header.seed = 1; header.seed <= 1000 && !found; header.seed++) {
+			memset(table, 0, header.table_size * sizeof(*table));
+			found = true;
+
+			for (int i = 0; i < cnt && found; i++) {
+				uint32_t slot = profiles_hash(profiles[i].selector, header.seed) & (header.table_size - 1);
+				found = table[slot] == 0;
+				table[slot] = i + 1;
+			}
+		}
+		if (!found) {
+			header.table_size *= 2;
+		}
+	}
+	header.seed--;
+
+	size_t entries_off = sizeof(header) + header.table_size * sizeof(*table);
+	size_t pool_off = entries_off + cnt * sizeof(struct profiles_entry);
+
+	out->len = 0;
+	buffer_append(out, &header, sizeof(header));
+	buffer_append(out, table, header.table_size * sizeof(*table));
+	buffer_reserve(out, cnt * sizeof(struct profiles_entry) + 1);
+	out->len = pool_off;
+	// The offset 0 in the pool means "not set".
+	buffer_append(out, "", 1);
+
+	for (int i = 0; i < cnt; i++) {
+		struct profiles_entry entry = {
+			.selector_off = out->len - pool_off,
+			.chunk_size = profiles[i].chunk_size,
+			.limit = profiles[i].limit,
+			.pacing_us = profiles[i].pacing_us,
+		};
+		buffer_append(out, profiles[i].selector, strlen(profiles[i].selector) + 1);
+
+		if (profiles[i].backend != NULL) {
+			entry.backend_off = out->len - pool_off;
+			buffer_append(out, profiles[i].backend, strlen(profiles[i].backend) + 1);
+		}
+		memcpy(out->data + entries_off + i * sizeof(entry), &entry, sizeof(entry));
+	}
+	free(table);
+}
+
+/**
+ * Validates the compiled profiles in `data` of the length `len` against
+ * the text file's `src_st`. Returns true if they are valid and up to date.
+ */
+static bool profiles_valid (const uchar *data, size_t len, const struct stat *src_st) {
+	const struct profiles_header *header = (const struct profiles_header *) data;
+
+	if (len < sizeof(*header) || header->magic != PROFILES_MAGIC
+			|| header->src_mtime != (int64_t) src_st->st_mtime
+			|| header->src_mtime_nsec != (int64_t) ST_MTIME_NSEC(src_st)
+			|| header->src_size != (int64_t) src_st->st_size
+			|| header->src_ino != (uint64_t) src_st->st_ino
+			|| header->table_size == 0 || (header->table_size & (header->table_size - 1)) != 0) {
+		return false;
+	}
+	size_t pool_off = sizeof(*header) + (size_t) header->table_size * sizeof(uint32_t)
+		+ (size_t) header->entries_cnt * sizeof(struct profiles_entry);
+
+	// The pool must be null-terminated, so strings can't overflow.
+	return pool_off < len && data[len - 1] == '\0';
+}
+
+/**
+ * Looks up the profile with the `selector` in the compiled profiles `data`.
+ * Returns the entry, or NULL if not found.
+ */
+static const struct profiles_entry *profiles_lookup (const uchar *data, size_t len, const char *selector) {
+	const struct profiles_header *header = (const struct profiles_header *) data;
+	const uint32_t *table = (const uint32_t *) (data + sizeof(*header));
+	const struct profiles_entry *entries = (const struct profiles_entry *) (table + header->table_size);
+	const char *pool = (const char *) (entries + header->entries_cnt);
+	size_t pool_len = len - ((const uchar *) pool - data);
+
+	uint32_t idx = table[profiles_hash(selector, header->seed) & (header->table_size - 1)];
+	if (idx == 0 || idx > header->entries_cnt || entries[idx - 1].selector_off >= pool_len) {
+		return NULL;
+	}
+	// A selector that's not in the table may hash to any slot.
+	if (!str_equal(pool + entries[idx - 1].selector_off, selector)) {
+		return NULL;
+	}
+	return &entries[idx - 1];
+}
+
+/**
+ * Applies the settings of the profile `entry` to the options; settings given
+ * on the command line are not overridden.
+ */
+static void profiles_apply_entry (const uchar *data, size_t len, const struct profiles_entry *entry) {
+	const struct profiles_header *header = (const struct profiles_header *) data;
+	const char *pool = (const char *) data + sizeof(*header)
+		+ header->table_size * sizeof(uint32_t)
+		+ header->entries_cnt * sizeof(struct profiles_entry);
+	size_t pool_len = len - ((const uchar *) pool - data);
+
+	if (entry->backend_off > 0 && entry->backend_off < pool_len && !opts.backend_given) {
+		const char *name = pool + entry->backend_off;
+
+		if (str_equal(name, "auto")) {
+			opts.backend = NULL;
+		} else if (backend_find(name) != NULL) {
+			opts.backend = strdup(name);
+		} else {
+			logerr("warning: Unknown backend in profile: %s", name);
+		}
+	}
+	if (entry->chunk_size >= 0 && entry->chunk_size <= PROFILES_MAX_CHUNK) {
+		opts.chunk_size = entry->chunk_size;
+	}
+	if (entry->limit >= 0) {
+		opts.payload_limit = entry->limit;
+	}
+	if (entry->pacing_us >= 0) {
+		opts.pacing_us = entry->pacing_us;
+	}
+}
+
+/**
+ * Writes the path of `filename` in the tty-copy's directory under the XDG
+ * base directory given by `env` (or `fallback` relative to $HOME) into
+ * `path`. Creates the directories if `create` is true.
+ *
+ * @return 0 on success, -1 if neither `env` nor HOME is set, or the path is
+ *   too long.
+ */
+static int xdg_path (char *path, size_t size, const char *env, const char *fallback,
+                     const char *filename, bool create) {
+	const char *base = getenv(env);
+	const char *home = getenv("HOME");
+	int n = 0;
+
+	if (base != NULL && *base != '\0') {
+		n = snprintf(path, size, "%s", base);
+	} else if (home != NULL && *home != '\0') {
+		n = snprintf(path, size, "%s/%s", home, fallback);
+	} else {
+		return -1;
+	}
+	if (n < 0 || (size_t) n >= size) {
+		return -1;
+	}
+	if (create) {
+		mkdir(path, 0700);
+	}
+	int m = snprintf(path + n, size - n, "/" PROGNAME);
+	if (m < 0 || (size_t) (n += m) >= size) {
+		return -1;
+	}
+	if (create) {
+		mkdir(path, 0700);
+	}
+	m = snprintf(path + n, size - n, "/%s", filename);
+	if (m < 0 || (size_t) (n + m) >= size) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Loads the terminal profiles (compiling them if needed) and applies the ones
+ * matching the current terminal to the options.
+ */
+static void profiles_load (void) {
+	char src_path[4096];
+	char cache_path[4096];
+	struct stat src_st;
+	struct stat cache_st;
+	struct buffer compiled = {0};
+	uchar *data = NULL;
+	size_t len = 0;
+	int fd = -1;
+
+	if (xdg_path(src_path, sizeof(src_path), "XDG_CONFIG_HOME", ".config", PROFILES_FILENAME, false) < 0
+			|| stat(src_path, &src_st) < 0) {
+		return;
+	}
+	if (xdg_path(cache_path, sizeof(cache_path), "XDG_CACHE_HOME", ".cache", PROFILES_CACHE_FILENAME, false) == 0
+			&& (fd = open(cache_path, O_RDONLY | O_CLOEXEC)) >= 0) {
+		if (fstat(fd, &cache_st) == 0 && cache_st.st_size > 0) {
+			len = cache_st.st_size;
+			if ((data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+				data = NULL;
+			}
+		}
+		close(fd);
+	}
+	if (data != NULL && !profiles_valid(data, len, &src_st)) {
+		munmap(data, len);
+		data = NULL;
+	}
+
+	if (data == NULL) {
+		struct profile *profiles = NULL;
+		int cnt = profiles_parse(src_path, &profiles);
+		if (cnt < 0) {
+			return;
+		}
+		profiles_compile(profiles, cnt, &src_st, &compiled);
+		for (int i = 0; i < cnt; i++) {
+			free(profiles[i].selector);
+			free(profiles[i].backend);
+		}
+		free(profiles);
+
+		// Write the cache atomically; if it fails, it will be compiled again
+		// next time.
+		char tmp_path[sizeof(cache_path) + 8];
+		if (xdg_path(cache_path, sizeof(cache_path), "XDG_CACHE_HOME", ".cache", PROFILES_CACHE_FILENAME, true) == 0) {
+			snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", cache_path);
+			if ((fd = mkstemp(tmp_path)) >= 0) {
+				int err = write_all(fd, compiled.data, compiled.len);
+				close(fd);
+				if (err < 0 || rename(tmp_path, cache_path) < 0) {
+					unlink(tmp_path);
+				}
+			}
+		}
+		data = compiled.data;
+		len = compiled.len;
+	}
+
+	const char *term = getenv("TERM");
+	const char *term_program = getenv("TERM_PROGRAM");
+	const char *mux = opts.is_tmux ? "tmux" : opts.is_screen ? "screen" : NULL;
+	char selector[256];
+	const struct profiles_entry *entry = NULL;
+
+	// In the order of increasing precedence.
+	if (term != NULL) {
+		snprintf(selector, sizeof(selector), "term=%s", term);
+		if ((entry = profiles_lookup(data, len, selector)) != NULL) {
+			profiles_apply_entry(data, len, entry);
+		}
+	}
+	if (term_program != NULL) {
+		snprintf(selector, sizeof(selector), "term_program=%s", term_program);
+		if ((entry = profiles_lookup(data, len, selector)) != NULL) {
+			profiles_apply_entry(data, len, entry);
+		}
+	}
+	if (mux != NULL) {
+		snprintf(selector, sizeof(selector), "mux=%s", mux);
+		if ((entry = profiles_lookup(data, len, selector)) != NULL) {
+			profiles_apply_entry(data, len, entry);
+		}
+	}
+
+	if (data == compiled.data) {
+		free(compiled.data);
+	} else {
+		munmap(data, len);
+	}
+}
+
+static volatile sig_atomic_t stop_listening = 0;
+
+static void handle_stop_signal (int signum) {
+	(void) signum;
+	stop_listening = 1;
+}
+
+/**
+ * Reads the data from the client connected on `fd` and copies it using
+ * the backend chain.
+ *
+ * @return 0 on success, or an exit code on error.
+ */
+static int serve_client (int fd) {
+	uchar header[SOCKET_HEADER_SIZE];
+	size_t header_len = 0;
+	ssize_t len = 0;
+
+	while (header_len < sizeof(header)) {
+		if ((len = read(fd, header + header_len, sizeof(header) - header_len)) <= 0) {
+			if (len < 0 && errno == EINTR) {
+				continue;
+			}
+			return ERR_IO;
+		}
+		header_len += len;
+	}
+	if (memcmp(header, SOCKET_MAGIC, 4) != 0 || header[4] != SOCKET_VERSION) {
+		logerr("%s", "Received invalid header, ignoring");
+		return ERR_GENERAL;
+	}
+	opts.primary = header[5] & SOCKET_FLAG_PRIMARY;
+	tty_init_seq();
+
+	double start = now_ms();
+	struct backend_chain chain;
+	int rc = 0;
+	backend_chain_init(&chain);
+	if ((rc = backend_chain_open(&chain)) != 0) {
+		metrics_record(rc, 0, now_ms() - start);
+		return rc;
+	}
+	uchar buf[READ_BUF_SIZE];
+	while ((len = read(fd, buf, sizeof(buf))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			rc = ERR_IO;
+			break;
+		}
+		if ((rc = chain.sink.write(&chain.sink, buf, len)) != 0) {
+			break;
+		}
+	}
+	int rc2 = chain.sink.close(&chain.sink);
+	rc = rc ? rc : rc2;
+	metrics_record(rc, chain.total, now_ms() - start);
+
+	return rc;
+}
+
+/**
+ * Listens on the Unix socket `opts.listen_path` and copies data sent by
+ * tty-copy --socket until interrupted.
+ *
+ * @return Exit code.
+ */
+static int listen_socket (void) {
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd = -1;
+
+	if (socket_addr(&addr, opts.listen_path) < 0) {
+		return ERR_WRONG_USAGE;
+	}
+	// Remove a stale socket left by a previous run.
+	if (lstat(opts.listen_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(opts.listen_path);
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		logerr("Failed to create socket: %s", strerror(errno));
+		return ERR_IO;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	// Only the owner may connect.
+	mode_t old_umask = umask(0077);
+	int err = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(old_umask);
+
+	if (err < 0 || listen(fd, 8) < 0) {
+		logerr("Failed to listen on %s: %s", opts.listen_path, strerror(errno));
+		close(fd);
+		return ERR_IO;
+	}
+
+	// Don't restart accept(2) on these signals, so we can clean up.
+	struct sigaction sa = { .sa_handler = handle_stop_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	// The listener is typically run in background; don't get stopped when
+	// writing to the terminal (with TOSTOP) or changing its modes (--sync).
+	signal(SIGTTOU, SIG_IGN);
+
+	while (!stop_listening) {
+		int client_fd = accept(fd, NULL, NULL);
+		if (client_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			logerr("Failed to accept connection: %s", strerror(errno));
+			break;
+		}
+		fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+		// Clients are served one at a time, so a stalled one mustn't block
+		// the others.
+		socket_set_timeout(client_fd);
+
+		uchar status = serve_client(client_fd);
+		(void) write_all(client_fd, &status, 1);
+		close(client_fd);
+
+		// Don't keep the terminal (and its modes) between clients.
+		tty_close();
+	}
+	close(fd);
+	unlink(opts.listen_path);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Writes the `nth` most recent entry of the local clipboard ring to stdout.
+ *
+ * @return Exit code.
+ */
+static int paste_local (const char *nth) {
+	struct buffer entry = {0};
+	struct ring *ring = NULL;
+	char *end = NULL;
+	int rc = EXIT_SUCCESS;
+
+	unsigned long n = strtoul(nth, &end, 10);
+	if (*end != '\0' || n < 1 || n > RING_SLOTS) {
+		logerr("Invalid entry number: %s (must be 1-%d)", nth, RING_SLOTS);
+		return ERR_WRONG_USAGE;
+	}
+	if ((ring = ring_open(false)) == NULL) {
+		return ERR_GENERAL;
+	}
+	if (ring_get(ring, n, &entry) < 0) {
+		logerr("No entry %lu in the local clipboard ring", n);
+		rc = ERR_GENERAL;
+	} else if (write_all(STDOUT_FILENO, entry.data, entry.len) < 0) {
+		logerr("/dev/stdout: write error: %s", strerror(errno));
+		rc = ERR_IO;
+	}
+	munmap(ring, sizeof(*ring));
+	free(entry.data);
+
+	return rc;
+}
+
+int main (int argc, char * const *argv) {
+	parse_opts(argc, argv);
+
+	if (opts.backend != NULL && backend_find(opts.backend) == NULL) {
+		logerr("Unknown backend: %s", opts.backend);
+		exit(ERR_WRONG_USAGE);
+	}
+	// The multiplexer responds to DA1 itself, while the passthrough sequence
+	// is forwarded to the outer terminal asynchronously.
+	if (opts.sync && (opts.is_tmux || opts.is_screen)) {
+		logerr("%s", "warning: --sync is not supported inside tmux or screen, ignoring");
+		opts.sync = false;
+	}
+	// Failure of a helper command is handled by the backend chain.
+	signal(SIGPIPE, SIG_IGN);
+
+	if (opts.op == OP_WRITE || opts.op == OP_BUNDLE || opts.op == OP_EXEC || opts.op == OP_LISTEN) {
+		profiles_load();
+	}
+
+	tty_init_seq();
+
+	int rc = EXIT_SUCCESS;
+	int exec_status = 0;
+	double copy_start = -1;
+	size_t copied = 0;
+	if (opts.op == OP_LISTEN) {
+		rc = listen_socket();
+
+	} else if (opts.op == OP_METRICS) {
+		rc = metrics_print();
+
+	} else if (opts.op == OP_PASTE_LOCAL) {
+		rc = paste_local(optind < argc ? argv[optind] : "1");
+
+	} else if (opts.op == OP_TEST) {
+		if (tty_open() < 0) {
+			exit(ERR_IO);
+		}
+		fputs("\0337", tty.file);  // save current terminal state
+
+		int col = get_cursor_column(tty.file);
+		fprintf(tty.file, "%s%s", tty.seq_start, tty.seq_end);
+		int col2 = get_cursor_column(tty.file);
+
+		if (col < 0 || col2 < 0 || col != col2) {
+			fputs("\0338", tty.file);  // restore terminal state
+			rc = ERR_GENERAL;
+		}
+	} else if (opts.op == OP_CLEAR) {
+		if (tty_open() < 0) {
+			exit(ERR_IO);
+		}
+		fprintf(tty.file, "%s!%s", tty.seq_start, tty.seq_end);
+		fflush(tty.file);
+
+	} else {
+		FILE *input = stdin;
+		char buf[OSC_SAFE_LIMIT] = "\0";
+		struct buffer bundle = {0};
+		struct buffer captured = {0};
+
+		if (opts.op == OP_EXEC) {
+			int status = exec_capture(argv + optind, &captured);
+			if (status < 0) {
+				rc = ERR_EXEC;
+				goto done;
+			}
+			exec_status = status;
+			// fmemopen(3) doesn't accept an empty buffer.
+			input = captured.len > 0
+				? fmemopen(captured.data, captured.len, "r")
+				: fopen("/dev/null", "r");
+
+		} else if (opts.op == OP_BUNDLE) {
+			if ((rc = bundle_files(argv + optind, argc - optind, &bundle)) != 0) {
+				goto done;
+			}
+			input = fmemopen(bundle.data, bundle.len, "r");
+
+		// There are remaining command line arguments, get the content from them
+		// instead of stdin.
+		} else if (argc > optind) {
+			size_t buf_len = 0;
+
+			for (int i = optind; i < argc; i++) {
+				size_t arg_len = strlen(argv[i]);
+
+				if (buf_len + arg_len + 2 > sizeof(buf)) {
+					logerr("Command line is too long (limit is %lu bytes)", sizeof(buf));
+					rc = ERR_GENERAL;
+					goto done;
+				}
+				if (buf_len > 0) {
+					buf[buf_len++] = ' ';
+				}
+				(void) strcpy(buf + buf_len, argv[i]);
+
+				buf[(buf_len += arg_len)] = '\0';
+			}
+			input = fmemopen(buf, buf_len, "r");
+		}
+
+		copy_start = now_ms();
+
+		// Build the whole pipeline before opening the backend, so that it's
+		// not started (e.g. clearing the clipboard) if the pipeline fails.
+		struct backend_chain chain;
+		backend_chain_init(&chain);
+
+		// Unlike plain text, a truncated bundle is useless. Other backends
+		// than tty are not limited by the terminal.
+		if (opts.op == OP_BUNDLE && bundle.len > opts.payload_limit) {
+			backend_chain_drop(&chain, "tty");
+
+			if (chain.cnt == 0) {
+				logerr("Bundle size (%lu kiB) exceeds %lu kiB, it would be truncated by terminals",
+					bundle.len / 1024, opts.payload_limit / 1024);
+				rc = ERR_GENERAL;
+				goto done;
+			}
+		}
+		struct sink *out = &chain.sink;
+		struct newline_trimmer trimmer;
+		struct line_filter filter;
+		static struct transcoder transcoder;
+
+		// The bundle is copied as is.
+		if (opts.op != OP_BUNDLE && opts.trim_newline) {
+			newline_trimmer_init(&trimmer, out);
+			out = &trimmer.sink;
+		}
+		if (opts.op != OP_BUNDLE && (opts.match_cnt > 0 || opts.exclude_cnt > 0)) {
+			line_filter_init(&filter, out);
+			out = &filter.sink;
+		}
+		if (opts.op != OP_BUNDLE && opts.from_charset != NULL) {
+			if (transcoder_init(&transcoder, opts.from_charset, out) < 0) {
+				logerr("Unsupported charset: %s", opts.from_charset);
+				rc = ERR_WRONG_USAGE;
+				goto done;
+			}
+			out = &transcoder.sink;
+		}
+
+		if ((rc = backend_chain_open(&chain)) != 0) {
+			goto done;
+		}
+
+		// Regular files are read ahead in parallel. If the file has grown
+		// meanwhile, the rest is read by fread below.
+		struct prefetcher prefetcher;
+		if (input == stdin && prefetcher_open(&prefetcher, STDIN_FILENO) == 0) {
+			const uchar *data = NULL;
+			ssize_t len = 0;
+
+			while ((len = prefetcher_next(&prefetcher, &data)) > 0) {
+				if ((rc = out->write(out, data, len)) != 0) {
+					break;
+				}
+			}
+			if (len < 0) {
+				logerr("/dev/stdin: read error: %s", strerror(errno));
+				rc = ERR_IO;
+			}
+			prefetcher_close(&prefetcher);
+		}
+
+		uchar read_buf[READ_BUF_SIZE];
+		size_t read_len = 0;
+		while (rc == 0 && (read_len = fread(read_buf, 1, sizeof(read_buf), input)) > 0) {
+			if ((rc = out->write(out, read_buf, read_len)) != 0) {
+				break;
+			}
+		}
+		int rc2 = out->close(out);
+		rc = rc ? rc : rc2;
+		copied = chain.total;
+
+		if (ferror(input)) {
+			logerr("/dev/stdin: read error: %s", strerror(errno));
+			rc = ERR_IO;
+		}
+	}
+
+	if (tty.file != NULL && ferror(tty.file)) {
+		logerr("%s: write error: %s", opts.tty_path, strerror(errno));
+		rc = ERR_IO;
+	}
+
+done:
+	if (copy_start >= 0) {
+		metrics_record(rc, copied, now_ms() - copy_start);
+	}
+	tty_close();
+
+	// With --exec, the command's exit status takes precedence.
+	return exec_status != 0 ? exec_status : rc;
 }